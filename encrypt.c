@@ -2,449 +2,2824 @@
 
 // Forward Declarations
 
-static void encrypt_rotate_key(unsigned char* key, unsigned int keylength, unsigned int shift);
-static void encrypt_block(unsigned char* block, unsigned int length, unsigned char* key, unsigned int keylength);
-static int encrypt_block_init(encrypt_block_info_t** blockinfo, unsigned int blockindex, unsigned int blocklength);
+static void encrypt_block(const encrypt_key_t* key, unsigned char* block, unsigned int length, const unsigned char* rotated);
+static void encrypt_block_rotated(unsigned char* block, unsigned int length, const unsigned char* key, unsigned long long keylength, unsigned long long shift);
+static void encrypt_kernels_init(void);
+static void encrypt_block_range(const encrypt_key_t* key, unsigned char* block, unsigned int length, unsigned long long offset, unsigned char* tile);
+static int encrypt_key_init(encrypt_key_t* key, char* keyfilename, size_t padlimit);
+static void encrypt_key_deinit(encrypt_key_t* key);
+static int encrypt_block_init(encrypt_block_info_t** blockinfo, unsigned long long blockindex, unsigned int blocklength, unsigned char checksum);
 static void encrypt_block_deinit(encrypt_block_info_t* info);
-static int encrypt_context_init(encrypt_context_t* context, unsigned char* key, unsigned int keylength, unsigned int threadcount);
+static int encrypt_ring_init(encrypt_ring_t* ring, unsigned int capacity);
+static void encrypt_checksum_add(encrypt_stats_t* stats, const encrypt_block_info_t* info);
+static void encrypt_ring_deinit(encrypt_ring_t* ring);
+static int encrypt_keystream_init(encrypt_context_t* context, unsigned int producercount, unsigned int blocklength);
+static void encrypt_keystream_deinit(encrypt_context_t* context);
+static int encrypt_context_init(encrypt_context_t* context, const encrypt_key_t* keys, unsigned int keycount, unsigned int threadcount, unsigned int producercount, unsigned int windowsize, unsigned int blocklength);
 static void encrypt_context_deinit(encrypt_context_t* context);
-static int encrypt_execute(unsigned char* key, unsigned int keylength, unsigned int threadcount);
 
-// Implementation
+// Limits
+
+#define ENCRYPT_PAD_LIMIT           (64u * 1024 * 1024)     // default budget for the keystream pad, in bytes
+#define ENCRYPT_PAD_MINIMUM         (64u * 1024)            // pads are repeated up to at least this length
+#define ENCRYPT_STREAM_CHUNK        (256u * 1024)           // bytes read at once when streaming against the pad
+#define ENCRYPT_REGISTER_LIMIT      64                      // largest key kept in registers, in bytes
+#define ENCRYPT_STREAMING_MINIMUM   4096                    // shorter runs keep regular stores
+#define ENCRYPT_CALIBRATION_SIZE    (64u * 1024 * 1024)     // bytes run through each store path for stats
+#define ENCRYPT_TILE_THRESHOLD      (2u * 1024 * 1024)      // keys at least this long are processed in tiles
+#define ENCRYPT_TILE_SIZE           (64u * 1024)            // bytes of a block processed per tile
+#define ENCRYPT_SPLIT_THRESHOLD     (64u * 1024 * 1024)     // bytes in flight in the window above which blocks are split
+#define ENCRYPT_CRC_CHUNK           (4u * 1024)             // bytes checksummed and encrypted together while in L1
+#define ENCRYPT_CRC_RECORD          (1u * 1024 * 1024)      // stream bytes covered by each sidecar record
+#define ENCRYPT_CRC_POLYNOMIAL      0x82F63B78u             // CRC32C polynomial, bit reversed
+#define ENCRYPT_KEY_LIMIT           4                       // most keys applied in cascade
+
+// Kernels
+
+#define ENCRYPT_TARGET_scalar
+#define ENCRYPT_TARGET_sse2         __attribute__((target("sse2")))
+#define ENCRYPT_TARGET_avx2         __attribute__((target("avx2")))
+#define ENCRYPT_TARGET_avx512       __attribute__((target("avx512f,avx512bw,prefer-vector-width=512")))
+#define ENCRYPT_TARGET_sse42        __attribute__((target("sse4.2")))
+
+static void encrypt_xor_scalar(unsigned char* block, const unsigned char* key, unsigned int length);
+static void encrypt_rotate_bits_scalar(unsigned char* key, unsigned int keylength, unsigned int shift);
+static void encrypt_register_scalar(uint64_t* limbs, unsigned int limbcount, unsigned int keylength, unsigned char* buffer, size_t length);
+static uint32_t encrypt_crc32c_scalar(uint32_t crc, const unsigned char* data, size_t length);
+static void encrypt_xor_cascade_scalar(unsigned char* block, const unsigned char* const* keys, unsigned int keycount, unsigned int length);
+
+static encrypt_kernels_t encrypt_kernels = { "scalar", encrypt_xor_scalar, encrypt_rotate_bits_scalar, encrypt_register_scalar, NULL, encrypt_crc32c_scalar, encrypt_xor_cascade_scalar };
+static uint32_t encrypt_crc32c_table[256];
+static const encrypt_fixed_kernel_t* encrypt_fixed_kernels = NULL;
+static pthread_once_t encrypt_kernels_once = PTHREAD_ONCE_INIT;
+
+static inline uint64_t encrypt_be64(uint64_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(value);
+#else
+    return value;
+#endif
+}
+
+static void encrypt_xor_scalar(unsigned char* block, const unsigned char* key, unsigned int length)
+{
+    unsigned int index = 0;
+    uint64_t data = 0, mask = 0;
+
+    for( ; index + sizeof(uint64_t) <= length; index += sizeof(uint64_t) )
+    {
+        memcpy( &data, block + index, sizeof(uint64_t) );
+        memcpy( &mask, key + index, sizeof(uint64_t) );
+        data ^= mask;
+        memcpy( block + index, &data, sizeof(uint64_t) );
+    }
+
+    for( ; index < length; index++ )
+    {
+        block[index] ^= key[index];
+    }
+}
+
+static void encrypt_rotate_bits_finish(unsigned char* key, unsigned int index, unsigned int keylength, unsigned int shift, unsigned char carry)
+{
+    for( ; index + 1 < keylength; index++ )
+    {
+        key[index] = (unsigned char)((key[index] << shift) | (key[index + 1] >> (8 - shift)));
+    }
+
+    key[keylength-1] = (unsigned char)((key[keylength-1] << shift) | carry);
+}
+
+//
+// Rotates the key left by fewer than 8 bits in a single pass. Each 64-bit limb is shifted as a
+// big-endian word and picks up the carry from the top bits of the following byte, which has not
+// been written yet since the pass moves forward. The bits shifted out of the first byte are
+// saved up front and become the carry into the last byte.
+//
+static void encrypt_rotate_bits_scalar(unsigned char* key, unsigned int keylength, unsigned int shift)
+{
+    unsigned int index = 0;
+    unsigned char carry = 0;
+    uint64_t word = 0;
+
+    assert( key != NULL );
+    assert( shift > 0 && shift < 8 );
+
+    carry = key[0] >> (8 - shift);
+
+    for( ; index + sizeof(uint64_t) < keylength; index += sizeof(uint64_t) )
+    {
+        memcpy( &word, key + index, sizeof(uint64_t) );
+        word = (encrypt_be64(word) << shift) | (key[index + sizeof(uint64_t)] >> (8 - shift));
+        word = encrypt_be64(word);
+        memcpy( key + index, &word, sizeof(uint64_t) );
+    }
+
+    encrypt_rotate_bits_finish(key, index, keylength, shift, carry);
+}
+
+//
+// Keys of up to 64 bytes fit in eight 64-bit limbs, which the register engine treats as one
+// big-endian number. It XORs the number into each block a limb at a time and rotates it by one
+// bit between blocks with a funnel shift across the limbs, the bit that wraps around going in
+// just above the zero padding of the last limb. The limb count is a constant in each
+// instantiation so the loops unroll and the key stays in registers for a whole buffer of
+// blocks. The limbs are copied in and out since stores to the buffer could alias them.
+//
+static inline __attribute__((always_inline)) void encrypt_register_blocks(uint64_t* limbs, unsigned int limbcount, unsigned int keylength, unsigned char* buffer, size_t length)
+{
+    unsigned int limb = 0, index = 0, padding = 0;
+    uint64_t state[8], carry = 0, data = 0;
+    size_t offset = 0;
+
+    padding = limbcount * 64 - keylength * 8;
+
+    for( limb = 0; limb < limbcount; limb++ )
+    {
+        state[limb] = limbs[limb];
+    }
+
+    for( offset = 0; offset < length; offset += keylength )
+    {
+        if( length - offset >= keylength )
+        {
+            for( limb = 0; limb < limbcount; limb++ )
+            {
+                if( (limb + 1) * 8 <= keylength )
+                {
+                    memcpy( &data, buffer + offset + limb * 8, sizeof(uint64_t) );
+                    data ^= encrypt_be64(state[limb]);
+                    memcpy( buffer + offset + limb * 8, &data, sizeof(uint64_t) );
+                }
+                else
+                {
+                    for( index = limb * 8; index < keylength; index++ )
+                        buffer[offset + index] ^= (unsigned char)(state[limb] >> (56 - 8 * (index % 8)));
+                }
+            }
+        }
+        else
+        {
+            for( index = 0; index < length - offset; index++ )
+                buffer[offset + index] ^= (unsigned char)(state[index / 8] >> (56 - 8 * (index % 8)));
+        }
+
+        carry = state[0] >> 63;
+
+        for( limb = 0; limb + 1 < limbcount; limb++ )
+        {
+            state[limb] = (state[limb] << 1) | (state[limb + 1] >> 63);
+        }
+
+        state[limbcount - 1] = (state[limbcount - 1] << 1) | (carry << padding);
+    }
+
+    for( limb = 0; limb < limbcount; limb++ )
+    {
+        limbs[limb] = state[limb];
+    }
+}
+
+static void encrypt_register_scalar(uint64_t* limbs, unsigned int limbcount, unsigned int keylength, unsigned char* buffer, size_t length)
+{
+    switch( limbcount )
+    {
+    case 1: encrypt_register_blocks(limbs, 1, keylength, buffer, length); break;
+    case 2: encrypt_register_blocks(limbs, 2, keylength, buffer, length); break;
+    case 3: encrypt_register_blocks(limbs, 3, keylength, buffer, length); break;
+    case 4: encrypt_register_blocks(limbs, 4, keylength, buffer, length); break;
+    case 5: encrypt_register_blocks(limbs, 5, keylength, buffer, length); break;
+    case 6: encrypt_register_blocks(limbs, 6, keylength, buffer, length); break;
+    case 7: encrypt_register_blocks(limbs, 7, keylength, buffer, length); break;
+    case 8: encrypt_register_blocks(limbs, 8, keylength, buffer, length); break;
+    default: assert( !"limb count out of range" ); break;
+    }
+}
+
+//
+// The cascade kernels XOR the keystreams of several keys into the block in a single pass, so
+// the block is loaded and stored once however many keys are applied.
+//
+static void encrypt_xor_cascade_scalar(unsigned char* block, const unsigned char* const* keys, unsigned int keycount, unsigned int length)
+{
+    unsigned int index = 0, key = 0;
+    uint64_t data = 0, mask = 0;
+
+    for( ; index + sizeof(uint64_t) <= length; index += sizeof(uint64_t) )
+    {
+        memcpy( &data, block + index, sizeof(uint64_t) );
+
+        for( key = 0; key < keycount; key++ )
+        {
+            memcpy( &mask, keys[key] + index, sizeof(uint64_t) );
+            data ^= mask;
+        }
+
+        memcpy( block + index, &data, sizeof(uint64_t) );
+    }
+
+    for( ; index < length; index++ )
+    {
+        for( key = 0; key < keycount; key++ )
+            block[index] ^= keys[key][index];
+    }
+}
+
+static uint32_t encrypt_crc32c_scalar(uint32_t crc, const unsigned char* data, size_t length)
+{
+    for( ; length > 0; data++, length-- )
+    {
+        crc = encrypt_crc32c_table[(crc ^ *data) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#ifdef ENCRYPT_X86
+
+//
+// The vector kernels bring the block pointer up to the vector alignment with a scalar head
+// so that the block is loaded and stored aligned, while the key which sits at the same offset
+// is loaded unaligned. Whatever is left over after the last full vector is done as a tail,
+// which also covers the short final block where length is less than the key length.
+//
+ENCRYPT_TARGET_sse2
+static void encrypt_xor_sse2(unsigned char* block, const unsigned char* key, unsigned int length)
+{
+    unsigned int index = 0;
+    __m128i data, mask;
+
+    for( ; index < length && ((uintptr_t)(block + index) & 15) != 0; index++ )
+    {
+        block[index] ^= key[index];
+    }
+
+    for( ; index + 16 <= length; index += 16 )
+    {
+        data = _mm_load_si128( (const __m128i*)(block + index) );
+        mask = _mm_loadu_si128( (const __m128i*)(key + index) );
+        _mm_store_si128( (__m128i*)(block + index), _mm_xor_si128(data, mask) );
+    }
+
+    for( ; index < length; index++ )
+    {
+        block[index] ^= key[index];
+    }
+}
+
+ENCRYPT_TARGET_avx2
+static void encrypt_xor_avx2(unsigned char* block, const unsigned char* key, unsigned int length)
+{
+    unsigned int index = 0;
+    __m256i data0, data1, mask0, mask1;
+
+    for( ; index < length && ((uintptr_t)(block + index) & 31) != 0; index++ )
+    {
+        block[index] ^= key[index];
+    }
+
+    for( ; index + 64 <= length; index += 64 )
+    {
+        data0 = _mm256_load_si256( (const __m256i*)(block + index) );
+        data1 = _mm256_load_si256( (const __m256i*)(block + index + 32) );
+        mask0 = _mm256_loadu_si256( (const __m256i*)(key + index) );
+        mask1 = _mm256_loadu_si256( (const __m256i*)(key + index + 32) );
+        _mm256_store_si256( (__m256i*)(block + index), _mm256_xor_si256(data0, mask0) );
+        _mm256_store_si256( (__m256i*)(block + index + 32), _mm256_xor_si256(data1, mask1) );
+    }
+
+    for( ; index + 32 <= length; index += 32 )
+    {
+        data0 = _mm256_load_si256( (const __m256i*)(block + index) );
+        mask0 = _mm256_loadu_si256( (const __m256i*)(key + index) );
+        _mm256_store_si256( (__m256i*)(block + index), _mm256_xor_si256(data0, mask0) );
+    }
+
+    for( ; index < length; index++ )
+    {
+        block[index] ^= key[index];
+    }
+}
+
+//
+// With AVX-512BW the head and the tail are done with a single masked load and store each
+// instead of a scalar loop, so short blocks never touch memory past the end of the block.
+//
+ENCRYPT_TARGET_avx512
+static void encrypt_xor_avx512(unsigned char* block, const unsigned char* key, unsigned int length)
+{
+    unsigned int index = 0, head = 0;
+    __mmask64 lanes = 0;
+    __m512i data, mask;
+
+    head = (64 - ((uintptr_t)block & 63)) & 63;
+
+    if( head > length )
+        head = length;
+
+    if( head > 0 )
+    {
+        lanes = (__mmask64)((1ULL << head) - 1);
+        data = _mm512_maskz_loadu_epi8( lanes, block );
+        mask = _mm512_maskz_loadu_epi8( lanes, key );
+        _mm512_mask_storeu_epi8( block, lanes, _mm512_xor_si512(data, mask) );
+        index = head;
+    }
+
+    for( ; index + 64 <= length; index += 64 )
+    {
+        data = _mm512_load_si512( (const void*)(block + index) );
+        mask = _mm512_loadu_si512( (const void*)(key + index) );
+        _mm512_store_si512( (void*)(block + index), _mm512_xor_si512(data, mask) );
+    }
+
+    if( index < length )
+    {
+        lanes = (__mmask64)((1ULL << (length - index)) - 1);
+        data = _mm512_maskz_loadu_epi8( lanes, block + index );
+        mask = _mm512_maskz_loadu_epi8( lanes, key + index );
+        _mm512_mask_storeu_epi8( block + index, lanes, _mm512_xor_si512(data, mask) );
+    }
+}
+
+//
+// The streaming kernels are the aligned XOR loops with non-temporal stores, so encrypted data
+// goes out to memory instead of displacing the key and the input still to be processed from
+// the cache. The fence orders the stores before the block is handed on or written out. Runs
+// too short to amortize the fence keep the regular stores.
+//
+ENCRYPT_TARGET_sse2
+static void encrypt_xor_stream_sse2(unsigned char* block, const unsigned char* key, unsigned int length)
+{
+    unsigned int index = 0;
+    __m128i data, mask;
+
+    if( length < ENCRYPT_STREAMING_MINIMUM )
+    {
+        encrypt_xor_sse2(block, key, length);
+        return;
+    }
+
+    for( ; index < length && ((uintptr_t)(block + index) & 15) != 0; index++ )
+    {
+        block[index] ^= key[index];
+    }
+
+    for( ; index + 16 <= length; index += 16 )
+    {
+        data = _mm_load_si128( (const __m128i*)(block + index) );
+        mask = _mm_loadu_si128( (const __m128i*)(key + index) );
+        _mm_stream_si128( (__m128i*)(block + index), _mm_xor_si128(data, mask) );
+    }
+
+    for( ; index < length; index++ )
+    {
+        block[index] ^= key[index];
+    }
+
+    _mm_sfence();
+}
+
+ENCRYPT_TARGET_avx2
+static void encrypt_xor_stream_avx2(unsigned char* block, const unsigned char* key, unsigned int length)
+{
+    unsigned int index = 0;
+    __m256i data, mask;
+
+    if( length < ENCRYPT_STREAMING_MINIMUM )
+    {
+        encrypt_xor_avx2(block, key, length);
+        return;
+    }
+
+    for( ; index < length && ((uintptr_t)(block + index) & 31) != 0; index++ )
+    {
+        block[index] ^= key[index];
+    }
+
+    for( ; index + 32 <= length; index += 32 )
+    {
+        data = _mm256_load_si256( (const __m256i*)(block + index) );
+        mask = _mm256_loadu_si256( (const __m256i*)(key + index) );
+        _mm256_stream_si256( (__m256i*)(block + index), _mm256_xor_si256(data, mask) );
+    }
+
+    for( ; index < length; index++ )
+    {
+        block[index] ^= key[index];
+    }
+
+    _mm_sfence();
+}
+
+ENCRYPT_TARGET_avx512
+static void encrypt_xor_stream_avx512(unsigned char* block, const unsigned char* key, unsigned int length)
+{
+    unsigned int index = 0, head = 0;
+    __mmask64 lanes = 0;
+    __m512i data, mask;
+
+    if( length < ENCRYPT_STREAMING_MINIMUM )
+    {
+        encrypt_xor_avx512(block, key, length);
+        return;
+    }
+
+    head = (64 - ((uintptr_t)block & 63)) & 63;
+
+    if( head > length )
+        head = length;
+
+    if( head > 0 )
+    {
+        lanes = (__mmask64)((1ULL << head) - 1);
+        data = _mm512_maskz_loadu_epi8( lanes, block );
+        mask = _mm512_maskz_loadu_epi8( lanes, key );
+        _mm512_mask_storeu_epi8( block, lanes, _mm512_xor_si512(data, mask) );
+        index = head;
+    }
+
+    for( ; index + 64 <= length; index += 64 )
+    {
+        data = _mm512_load_si512( (const void*)(block + index) );
+        mask = _mm512_loadu_si512( (const void*)(key + index) );
+        _mm512_stream_si512( (void*)(block + index), _mm512_xor_si512(data, mask) );
+    }
+
+    if( index < length )
+    {
+        lanes = (__mmask64)((1ULL << (length - index)) - 1);
+        data = _mm512_maskz_loadu_epi8( lanes, block + index );
+        mask = _mm512_maskz_loadu_epi8( lanes, key + index );
+        _mm512_mask_storeu_epi8( block + index, lanes, _mm512_xor_si512(data, mask) );
+    }
+
+    _mm_sfence();
+}
+
+//
+// The vector rotations shift every byte by the same amount within 16-bit lanes and mask off
+// the bits that crossed into the neighbouring byte. The bits carried in from the next byte,
+// including across lane and vector boundaries, come from a second load one byte further on.
+// That byte is always ahead of what has been stored, so the rotation can be done inplace.
+//
+ENCRYPT_TARGET_avx2
+static void encrypt_rotate_bits_avx2(unsigned char* key, unsigned int keylength, unsigned int shift)
+{
+    unsigned int index = 0;
+    unsigned char carry = 0;
+    __m256i current, next, high, low;
+    __m256i highmask = _mm256_set1_epi8( (char)(0xFF << shift) );
+    __m256i lowmask = _mm256_set1_epi8( (char)(0xFF >> (8 - shift)) );
+    __m128i highcount = _mm_cvtsi32_si128( (int) shift );
+    __m128i lowcount = _mm_cvtsi32_si128( (int)(8 - shift) );
+
+    assert( key != NULL );
+    assert( shift > 0 && shift < 8 );
+
+    carry = key[0] >> (8 - shift);
+
+    for( ; index + 32 < keylength; index += 32 )
+    {
+        current = _mm256_loadu_si256( (const __m256i*)(key + index) );
+        next = _mm256_loadu_si256( (const __m256i*)(key + index + 1) );
+
+        high = _mm256_and_si256( _mm256_sll_epi16(current, highcount), highmask );
+        low = _mm256_and_si256( _mm256_srl_epi16(next, lowcount), lowmask );
 
-static void encrypt_rotate_key_bits(unsigned char* key, unsigned int keylength, unsigned char shift)
+        _mm256_storeu_si256( (__m256i*)(key + index), _mm256_or_si256(high, low) );
+    }
+
+    encrypt_rotate_bits_finish(key, index, keylength, shift, carry);
+}
+
+ENCRYPT_TARGET_avx512
+static void encrypt_rotate_bits_avx512(unsigned char* key, unsigned int keylength, unsigned int shift)
 {
     unsigned int index = 0;
     unsigned char carry = 0;
+    __m512i current, next, high, low;
+    __m512i highmask = _mm512_set1_epi8( (char)(0xFF << shift) );
+    __m512i lowmask = _mm512_set1_epi8( (char)(0xFF >> (8 - shift)) );
+    __m128i highcount = _mm_cvtsi32_si128( (int) shift );
+    __m128i lowcount = _mm_cvtsi32_si128( (int)(8 - shift) );
 
     assert( key != NULL );
-    
-    for( ; shift > 0; shift-- )
+    assert( shift > 0 && shift < 8 );
+
+    carry = key[0] >> (8 - shift);
+
+    for( ; index + 64 < keylength; index += 64 )
+    {
+        current = _mm512_loadu_si512( (const void*)(key + index) );
+        next = _mm512_loadu_si512( (const void*)(key + index + 1) );
+
+        high = _mm512_and_si512( _mm512_sll_epi16(current, highcount), highmask );
+        low = _mm512_and_si512( _mm512_srl_epi16(next, lowcount), lowmask );
+
+        _mm512_storeu_si512( (void*)(key + index), _mm512_or_si512(high, low) );
+    }
+
+    encrypt_rotate_bits_finish(key, index, keylength, shift, carry);
+}
+
+//
+// With AVX-512 a key of up to 64 bytes fits in a single register as eight big-endian limbs.
+// Rotating it is a lane permute that lines each limb up with its successor and a pair of
+// shifts, with the bits that wrap around shifted over the padding of the last limb. A byte
+// shuffle turns the limbs back into key order and masked loads and stores cover exactly one
+// block, so blocks of any length up to 64 bytes are XORed without a scalar loop. Four blocks
+// are done per step with four copies of the key one bit apart, each advanced by four bits, so
+// the rotations form independent dependency chains.
+//
+ENCRYPT_TARGET_avx512
+static inline __m512i encrypt_register_rotate_avx512(__m512i key, __m512i order, __m512i padding, unsigned int bits)
+{
+    __m512i next = _mm512_permutexvar_epi64( order, key );
+
+    return _mm512_or_si512( _mm512_slli_epi64(key, bits),
+                            _mm512_sllv_epi64(_mm512_srli_epi64(next, 64 - bits), padding) );
+}
+
+ENCRYPT_TARGET_avx512
+static void encrypt_register_avx512(uint64_t* limbs, unsigned int limbcount, unsigned int keylength, unsigned char* buffer, size_t length)
+{
+    unsigned int limb = 0, step = 0;
+    uint64_t successor[8], padding[8];
+    size_t offset = 0;
+    __mmask64 lanes = 0;
+    __m512i key[4], data, order, shift, swap;
+
+    assert( limbcount > 0 && limbcount <= 8 );
+
+    for( limb = 0; limb < 8; limb++ )
+    {
+        successor[limb] = limb + 1 < limbcount ? limb + 1 : (limb + 1 == limbcount ? 0 : limb);
+        padding[limb] = limb + 1 == limbcount ? limbcount * 64 - keylength * 8 : 0;
+    }
+
+    order = _mm512_loadu_si512( (const void*) successor );
+    shift = _mm512_loadu_si512( (const void*) padding );
+    swap = _mm512_set_epi8( 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+                            8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+                            8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+                            8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7 );
+
+    key[0] = _mm512_loadu_si512( (const void*) limbs );
+
+    for( step = 1; step < 4; step++ )
+    {
+        key[step] = encrypt_register_rotate_avx512( key[step - 1], order, shift, 1 );
+    }
+
+    lanes = keylength < 64 ? (__mmask64)((1ULL << keylength) - 1) : (__mmask64) ~0ULL;
+
+    for( ; length - offset >= 4 * (size_t)keylength; offset += 4 * (size_t)keylength )
+    {
+        for( step = 0; step < 4; step++ )
+        {
+            data = _mm512_maskz_loadu_epi8( lanes, buffer + offset + step * keylength );
+            data = _mm512_xor_si512( data, _mm512_shuffle_epi8(key[step], swap) );
+            _mm512_mask_storeu_epi8( buffer + offset + step * keylength, lanes, data );
+
+            key[step] = encrypt_register_rotate_avx512( key[step], order, shift, 4 );
+        }
+    }
+
+    for( step = 0; offset < length; offset += keylength, step++ )
+    {
+        if( length - offset < keylength )
+            lanes = (__mmask64)((1ULL << (length - offset)) - 1);
+
+        data = _mm512_maskz_loadu_epi8( lanes, buffer + offset );
+        data = _mm512_xor_si512( data, _mm512_shuffle_epi8(key[step], swap) );
+        _mm512_mask_storeu_epi8( buffer + offset, lanes, data );
+    }
+
+    if( step == 4 )
+    {
+        key[0] = encrypt_register_rotate_avx512( key[0], order, shift, 4 );
+        step = 0;
+    }
+
+    _mm512_storeu_si512( (void*) limbs, key[step] );
+}
+
+ENCRYPT_TARGET_sse2
+static void encrypt_xor_cascade_sse2(unsigned char* block, const unsigned char* const* keys, unsigned int keycount, unsigned int length)
+{
+    unsigned int index = 0, key = 0;
+    __m128i data;
+
+    for( ; index + 16 <= length; index += 16 )
     {
-        carry = (key[0] & 0x80) != 0;
+        data = _mm_loadu_si128( (const __m128i*)(block + index) );
+
+        for( key = 0; key < keycount; key++ )
+            data = _mm_xor_si128( data, _mm_loadu_si128( (const __m128i*)(keys[key] + index) ) );
+
+        _mm_storeu_si128( (__m128i*)(block + index), data );
+    }
+
+    for( ; index < length; index++ )
+    {
+        for( key = 0; key < keycount; key++ )
+            block[index] ^= keys[key][index];
+    }
+}
+
+ENCRYPT_TARGET_avx2
+static void encrypt_xor_cascade_avx2(unsigned char* block, const unsigned char* const* keys, unsigned int keycount, unsigned int length)
+{
+    unsigned int index = 0, key = 0;
+    __m256i data;
+
+    for( ; index + 32 <= length; index += 32 )
+    {
+        data = _mm256_loadu_si256( (const __m256i*)(block + index) );
+
+        for( key = 0; key < keycount; key++ )
+            data = _mm256_xor_si256( data, _mm256_loadu_si256( (const __m256i*)(keys[key] + index) ) );
+
+        _mm256_storeu_si256( (__m256i*)(block + index), data );
+    }
+
+    for( ; index < length; index++ )
+    {
+        for( key = 0; key < keycount; key++ )
+            block[index] ^= keys[key][index];
+    }
+}
+
+//
+// AVX-512 folds two keystreams into the block per instruction with a three-way XOR, the
+// ternary logic function 0x96, and handles the tail with masked loads and stores.
+//
+ENCRYPT_TARGET_avx512
+static void encrypt_xor_cascade_avx512(unsigned char* block, const unsigned char* const* keys, unsigned int keycount, unsigned int length)
+{
+    unsigned int index = 0, key = 0;
+    __mmask64 lanes = ~(__mmask64)0;
+    __m512i data;
+
+    for( ; index < length; index += 64 )
+    {
+        if( length - index < 64 )
+            lanes = (__mmask64)((1ULL << (length - index)) - 1);
+
+        data = _mm512_maskz_loadu_epi8( lanes, block + index );
+
+        for( key = 0; key + 1 < keycount; key += 2 )
+        {
+            data = _mm512_ternarylogic_epi64( data,
+                                              _mm512_maskz_loadu_epi8( lanes, keys[key] + index ),
+                                              _mm512_maskz_loadu_epi8( lanes, keys[key + 1] + index ),
+                                              0x96 );
+        }
+
+        if( key < keycount )
+            data = _mm512_xor_si512( data, _mm512_maskz_loadu_epi8( lanes, keys[key] + index ) );
+
+        _mm512_mask_storeu_epi8( block + index, lanes, data );
+    }
+}
+
+ENCRYPT_TARGET_sse42
+static uint32_t encrypt_crc32c_sse42(uint32_t crc, const unsigned char* data, size_t length)
+{
+#ifdef __x86_64__
+    uint64_t state = crc, value = 0;
+
+    for( ; length >= sizeof(uint64_t); data += sizeof(uint64_t), length -= sizeof(uint64_t) )
+    {
+        memcpy( &value, data, sizeof(uint64_t) );
+        state = _mm_crc32_u64(state, value);
+    }
+
+    crc = (uint32_t) state;
+#endif
+
+    for( ; length > 0; data++, length-- )
+    {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+
+    return crc;
+}
+
+#endif // ENCRYPT_X86
+
+//
+// Specialized kernels for the common key lengths are generated from the generic ones. Each
+// length gets a copy of the XOR kernel of every instruction set, flattened with the length
+// folded in as a constant, so trip counts are fixed and the loops unroll fully or in large
+// steps. Full blocks of the fixed length use a restrict-qualified loop the compiler
+// vectorizes for the target, short final blocks go to the generic XOR kernel.
+//
+#define ENCRYPT_FIXED_LENGTHS(generate, isa) \
+    generate(isa, 16) generate(isa, 32) generate(isa, 64) generate(isa, 128) \
+    generate(isa, 256) generate(isa, 512) generate(isa, 1024) generate(isa, 4096)
+
+#define ENCRYPT_FIXED_KERNELS(isa, length) \
+    ENCRYPT_TARGET_##isa __attribute__((flatten)) \
+    static void encrypt_xor_##isa##_##length(unsigned char* block, const unsigned char* key, unsigned int blocklength) \
+    { \
+        if( blocklength == length ) \
+            encrypt_xor_fixed(block, key, length); \
+        else \
+            encrypt_xor_##isa(block, key, blocklength); \
+    }
+
+#define ENCRYPT_FIXED_ENTRY(isa, length) \
+    { length, encrypt_xor_##isa##_##length },
+
+#define ENCRYPT_FIXED_COUNT         8
+
+static inline void encrypt_xor_fixed(unsigned char* restrict block, const unsigned char* restrict key, unsigned int length)
+{
+    unsigned int index = 0;
+
+#pragma GCC unroll 16
+    for( index = 0; index < length; index++ )
+    {
+        block[index] ^= key[index];
+    }
+}
+
+ENCRYPT_FIXED_LENGTHS(ENCRYPT_FIXED_KERNELS, scalar)
+
+static const encrypt_fixed_kernel_t encrypt_fixed_scalar[ENCRYPT_FIXED_COUNT] =
+{
+    ENCRYPT_FIXED_LENGTHS(ENCRYPT_FIXED_ENTRY, scalar)
+};
+
+#ifdef ENCRYPT_X86
+
+ENCRYPT_FIXED_LENGTHS(ENCRYPT_FIXED_KERNELS, sse2)
+ENCRYPT_FIXED_LENGTHS(ENCRYPT_FIXED_KERNELS, avx2)
+ENCRYPT_FIXED_LENGTHS(ENCRYPT_FIXED_KERNELS, avx512)
+
+static const encrypt_fixed_kernel_t encrypt_fixed_sse2[ENCRYPT_FIXED_COUNT] =
+{
+    ENCRYPT_FIXED_LENGTHS(ENCRYPT_FIXED_ENTRY, sse2)
+};
+
+static const encrypt_fixed_kernel_t encrypt_fixed_avx2[ENCRYPT_FIXED_COUNT] =
+{
+    ENCRYPT_FIXED_LENGTHS(ENCRYPT_FIXED_ENTRY, avx2)
+};
+
+static const encrypt_fixed_kernel_t encrypt_fixed_avx512[ENCRYPT_FIXED_COUNT] =
+{
+    ENCRYPT_FIXED_LENGTHS(ENCRYPT_FIXED_ENTRY, avx512)
+};
+
+#endif // ENCRYPT_X86
+
+//
+// The kernels are picked once from CPUID, the widest instruction set supported by the
+// processor wins. Everything else calls through the encrypt_kernels table afterwards.
+//
+static void encrypt_kernels_select(void)
+{
+    unsigned int index = 0, bit = 0;
+    uint32_t crc = 0;
+
+    encrypt_fixed_kernels = encrypt_fixed_scalar;
+
+    for( index = 0; index < 256; index++ )
+    {
+        for( crc = index, bit = 0; bit < 8; bit++ )
+            crc = crc & 1 ? (crc >> 1) ^ ENCRYPT_CRC_POLYNOMIAL : crc >> 1;
+
+        encrypt_crc32c_table[index] = crc;
+    }
+
+#ifdef ENCRYPT_X86
+    __builtin_cpu_init();
+
+    if( __builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512bw") )
+    {
+        encrypt_kernels.name = "avx512";
+        encrypt_kernels.xor_block = encrypt_xor_avx512;
+        encrypt_kernels.xor_stream = encrypt_xor_stream_avx512;
+        encrypt_kernels.rotate_bits = encrypt_rotate_bits_avx512;
+        encrypt_kernels.register_blocks = encrypt_register_avx512;
+        encrypt_kernels.xor_cascade = encrypt_xor_cascade_avx512;
+        encrypt_fixed_kernels = encrypt_fixed_avx512;
+    }
+    else if( __builtin_cpu_supports("avx2") )
+    {
+        encrypt_kernels.name = "avx2";
+        encrypt_kernels.xor_block = encrypt_xor_avx2;
+        encrypt_kernels.xor_stream = encrypt_xor_stream_avx2;
+        encrypt_kernels.rotate_bits = encrypt_rotate_bits_avx2;
+        encrypt_kernels.xor_cascade = encrypt_xor_cascade_avx2;
+        encrypt_fixed_kernels = encrypt_fixed_avx2;
+    }
+    else if( __builtin_cpu_supports("sse2") )
+    {
+        encrypt_kernels.name = "sse2";
+        encrypt_kernels.xor_block = encrypt_xor_sse2;
+        encrypt_kernels.xor_stream = encrypt_xor_stream_sse2;
+        encrypt_kernels.xor_cascade = encrypt_xor_cascade_sse2;
+        encrypt_fixed_kernels = encrypt_fixed_sse2;
+    }
+
+    if( __builtin_cpu_supports("sse4.2") )
+    {
+        encrypt_kernels.crc32c = encrypt_crc32c_sse42;
+    }
+#endif
+}
+
+static void encrypt_kernels_init(void)
+{
+    pthread_once( &encrypt_kernels_once, encrypt_kernels_select );
+}
+
+//
+// Keys of one of the common lengths get the specialized XOR kernel from the dispatch table,
+// any other length uses the generic kernels.
+//
+static void encrypt_kernels_specialize(encrypt_kernels_t* kernels, unsigned long long keylength)
+{
+    unsigned int index = 0;
+
+    *kernels = encrypt_kernels;
+
+    for( index = 0; index < ENCRYPT_FIXED_COUNT; index++ )
+    {
+        if( encrypt_fixed_kernels[index].keylength == keylength )
+        {
+            kernels->xor_block = encrypt_fixed_kernels[index].xor_block;
+            break;
+        }
+    }
+}
+
+// Implementation
+
+static void encrypt_block(const encrypt_key_t* key, unsigned char* block, unsigned int length, const unsigned char* rotated)
+{
+    assert( block != NULL && rotated != NULL );
+    assert( key != NULL && length <= key->length );
+
+    key->kernels.xor_block(block, rotated, length);
+}
+
+//
+// XORs the block against the key rotated left by shift bits without materializing the rotated
+// key. Byte j of the rotated key starts at bit offset 8*j + shift of the original key, so it is
+// byte (j + shift/8) mod keylength funnel shifted with the byte that follows it. Stretches that
+// do not run into the end of the key are done 64 bits at a time, where the word shift pulls in
+// the neighbouring bits for the first seven bytes and only the last byte needs the next one.
+//
+static void encrypt_block_rotated(unsigned char* block, unsigned int length, const unsigned char* key, unsigned long long keylength, unsigned long long shift)
+{
+    unsigned int index = 0, run = 0, bits = 0;
+    unsigned long long pos = 0;
+    uint64_t word = 0, data = 0;
+
+    assert( block != NULL );
+    assert( key != NULL && length <= keylength );
+
+    shift %= keylength * 8;
+    pos = shift / 8;
+    bits = (unsigned int)(shift % 8);
+
+    if( bits == 0 )
+    {
+        for( ; index < length; index += run, pos = 0 )
+        {
+            run = length - index;
+
+            if( run > keylength - pos )
+                run = (unsigned int)(keylength - pos);
+
+            encrypt_kernels.xor_block(block + index, key + pos, run);
+        }
+
+        return;
+    }
+
+    while( index < length )
+    {
+        for( ; index + sizeof(uint64_t) <= length && pos + sizeof(uint64_t) < keylength;
+             index += sizeof(uint64_t), pos += sizeof(uint64_t) )
+        {
+            memcpy( &word, key + pos, sizeof(uint64_t) );
+            word = (encrypt_be64(word) << bits) | (key[pos + sizeof(uint64_t)] >> (8 - bits));
+
+            memcpy( &data, block + index, sizeof(uint64_t) );
+            data ^= encrypt_be64(word);
+            memcpy( block + index, &data, sizeof(uint64_t) );
+        }
+
+        if( index < length )
+        {
+            block[index] ^= (unsigned char)((key[pos] << bits) |
+                                            (key[pos + 1 < keylength ? pos + 1 : 0] >> (8 - bits)));
+            index++;
+
+            if( ++pos == keylength )
+                pos = 0;
+        }
+    }
+}
+
+//
+// The schedule and the pad are built in parts on first use rather than up front, so the first
+// blocks are processed as soon as the parts they need are there. In the parallel engine this
+// spreads the building over the workers, each building the parts its blocks need while the
+// others wait for their own. A part is built under its lock and marked ready after, so once
+// built it is read without taking the lock.
+//
+static int encrypt_parts_init(encrypt_parts_t* parts, unsigned int count)
+{
+    int retval = 0;
+    unsigned int index = 0;
+
+    assert( parts != NULL && count > 0 );
+
+    verify_bool( (parts->ready = (unsigned char*) malloc( count )) != NULL );
+    verify_bool( (parts->locks = (pthread_mutex_t*) malloc( sizeof(pthread_mutex_t) * count )) != NULL );
+
+    memset( parts->ready, 0, count );
+
+    for( index = 0; index < count; index++ )
+    {
+        verify( pthread_mutex_init(&parts->locks[index], NULL) );
+        parts->count++;
+    }
+
+exit:
+    return retval;
+}
+
+static void encrypt_parts_deinit(encrypt_parts_t* parts)
+{
+    unsigned int index = 0;
+
+    for( index = 0; index < parts->count; index++ )
+    {
+        pthread_mutex_destroy( &parts->locks[index] );
+    }
+
+    parts->count = 0;
+
+    safe_free( parts->locks );
+    safe_free( parts->ready );
+}
+
+static void encrypt_parts_build(const encrypt_key_t* key, const encrypt_parts_t* parts, unsigned int part, encrypt_build_routine_t build)
+{
+    assert( part < parts->count );
+
+    if( __atomic_load_n(&parts->ready[part], __ATOMIC_ACQUIRE) )
+        return;
+
+    pthread_mutex_lock( &parts->locks[part] );
+
+    if( !parts->ready[part] )
+    {
+        build(key, part);
+        __atomic_store_n( &parts->ready[part], 1, __ATOMIC_RELEASE );
+    }
+
+    pthread_mutex_unlock( &parts->locks[part] );
+}
+
+static void encrypt_key_phase_build(const encrypt_key_t* key, unsigned int phase)
+{
+    unsigned char* image = key->schedule + (size_t)phase * key->length * 2;
+
+    memset( image, 0, key->length );
+    encrypt_block_rotated(image, (unsigned int) key->length, key->data, key->length, phase);
+    memcpy( image + key->length, image, key->length );
+}
+
+//
+// Any rotation of the key is a byte offset into one of only 8 bit-phase images of the key, so
+// the schedule holds the key rotated by 0 to 7 bits, each laid out twice back to back. The key
+// rotated by shift bits is then the keylength bytes starting at byte shift/8 of image shift%8
+// and can be handed out as a pointer into the read-only schedule without copying or rotating.
+// Keys of ENCRYPT_TILE_THRESHOLD and more are processed in tiles and go without a schedule,
+// since their images would be far out of cache and cost more to stream than the base key.
+//
+static int encrypt_key_schedule_init(encrypt_key_t* key)
+{
+    int retval = 0;
+
+    assert( key != NULL && key->data != NULL );
+
+    key->schedule = NULL;
+    key->tiled = key->length >= ENCRYPT_TILE_THRESHOLD;
+
+    if( key->tiled )
+        goto exit;
+
+    verify_bool( (key->schedule = (unsigned char*) malloc( (size_t)key->length * 16 )) != NULL );
+    verify( encrypt_parts_init(&key->phases, 8) );
+
+exit:
+    return retval;
+}
+
+static const unsigned char* encrypt_key_rotated(const encrypt_key_t* key, unsigned long long shift)
+{
+    assert( key != NULL && key->schedule != NULL );
+
+    shift %= key->length * 8;
+
+    encrypt_parts_build(key, &key->phases, (unsigned int)(shift % 8), encrypt_key_phase_build);
+
+    return key->schedule + (size_t)(shift % 8) * key->length * 2 + shift / 8;
+}
+
+static unsigned long long encrypt_key_shift(const encrypt_key_t* key, unsigned long long offset)
+{
+    unsigned long long shift = offset / key->length + (offset % key->length) * 8;
+
+    return shift % (key->length * 8);
+}
+
+//
+// Fills the buffer with the keystream from the given stream offset on, block by block.
+//
+static void encrypt_keystream_fill(const encrypt_key_t* key, unsigned long long offset, unsigned char* buffer, size_t length)
+{
+    unsigned int run = 0;
+
+    for( ; length > 0; buffer += run, offset += run, length -= run )
+    {
+        run = length < ENCRYPT_STREAM_CHUNK ? (unsigned int) length : ENCRYPT_STREAM_CHUNK;
+
+        if( run > key->length - offset % key->length )
+            run = (unsigned int)(key->length - offset % key->length);
+
+        if( key->schedule != NULL )
+        {
+            memcpy( buffer, encrypt_key_rotated(key, encrypt_key_shift(key, offset)), run );
+        }
+        else
+        {
+            memset( buffer, 0, run );
+            encrypt_block_rotated(buffer, run, key->data, key->length, encrypt_key_shift(key, offset));
+        }
+    }
+}
+
+//
+// Every pad region is filled straight from the schedule at its own stream offset, the pad
+// being a whole number of periods, so repeated periods need no copy of the first one.
+//
+static void encrypt_pad_region_build(const encrypt_key_t* key, unsigned int region)
+{
+    size_t offset = (size_t)region * ENCRYPT_STREAM_CHUNK;
+    size_t length = key->padlength - offset;
+
+    if( length > ENCRYPT_STREAM_CHUNK )
+        length = ENCRYPT_STREAM_CHUNK;
+
+    encrypt_keystream_fill(key, offset, key->pad + offset, length);
+}
+
+//
+// The keystream repeats every keylength * 8 blocks, that is every 8 * keylength^2 bytes. When
+// that period fits in the budget the whole keystream is laid out once and encryption becomes a
+// plain XOR of the input against the pad at the stream offset, ignoring block boundaries. Short
+// periods are repeated so that every run against the pad is at least ENCRYPT_PAD_MINIMUM long.
+//
+static int encrypt_key_pad_init(encrypt_key_t* key, size_t padlimit)
+{
+    int retval = 0;
+    unsigned long long period = 0;
+
+    assert( key != NULL && key->data != NULL );
+
+    key->pad = NULL;
+    key->padlength = 0;
+
+    if( key->length > padlimit / key->length / 8 )
+        goto exit;
+
+    period = key->length * key->length * 8;
+
+    key->padlength = (size_t) period;
+
+    while( key->padlength < ENCRYPT_PAD_MINIMUM && key->padlength + period <= padlimit )
+        key->padlength += (size_t) period;
+
+    verify_bool( (key->pad = (unsigned char*) malloc( key->padlength )) != NULL );
+    verify( encrypt_parts_init(&key->regions, (unsigned int)((key->padlength + ENCRYPT_STREAM_CHUNK - 1) / ENCRYPT_STREAM_CHUNK)) );
+
+exit:
+    if( retval != 0 )
+    {
+        safe_free( key->pad );
+        key->padlength = 0;
+    }
+
+    return retval;
+}
+
+static void encrypt_copy(unsigned char* block, const unsigned char* key, unsigned int length)
+{
+    memcpy( block, key, length );
+}
+
+//
+// Runs the routine over the buffer against the pad from the stream offset on, wrapping around
+// at the end of the pad: XOR for data, a plain copy of the keystream for holes in the input.
+//
+static void encrypt_pad_walk(const encrypt_key_t* key, unsigned long long offset, unsigned char* buffer, size_t length, encrypt_xor_routine_t routine)
+{
+    size_t pos = 0, run = 0, region = 0;
+
+    assert( key != NULL && key->pad != NULL );
+
+    for( pos = (size_t)(offset % key->padlength); length > 0; pos = 0 )
+    {
+        run = key->padlength - pos;
+
+        if( run > length )
+            run = length;
+
+        for( region = pos / ENCRYPT_STREAM_CHUNK; region <= (pos + run - 1) / ENCRYPT_STREAM_CHUNK; region++ )
+        {
+            encrypt_parts_build(key, &key->regions, (unsigned int) region, encrypt_pad_region_build);
+        }
+
+        routine(buffer, key->pad + pos, (unsigned int) run);
+
+        buffer += run;
+        length -= run;
+    }
+}
+
+static void encrypt_pad_apply(const encrypt_key_t* key, unsigned long long offset, unsigned char* buffer, size_t length)
+{
+    encrypt_pad_walk(key, offset, buffer, length, key->kernels.xor_block);
+}
+
+//
+// Zeros XOR the keystream are the keystream, so holes in the input are filled with it directly.
+//
+static void encrypt_keystream_copy(const encrypt_key_t* key, unsigned long long offset, unsigned char* buffer, size_t length)
+{
+    if( key->pad != NULL )
+    {
+        encrypt_pad_walk(key, offset, buffer, length, encrypt_copy);
+    }
+    else
+    {
+        encrypt_keystream_fill(key, offset, buffer, length);
+    }
+}
+
+//
+// Copies length bytes of the key rotated left by shift bits into the slice. The source bytes,
+// plus one for the bits carried into the last byte, are copied as they are, wrapping around
+// the end of the key, and then rotated by the remaining bits inplace. The byte picked up by the
+// extra copy is left over at the end, so the slice must have room for length + 1 bytes.
+//
+static void encrypt_key_slice(const encrypt_key_t* key, unsigned long long shift, unsigned char* slice, unsigned int length)
+{
+    unsigned int bits = 0, copied = 0, run = 0, total = 0;
+    unsigned long long pos = 0;
+
+    assert( key != NULL && slice != NULL );
+
+    shift %= key->length * 8;
+    pos = shift / 8;
+    bits = (unsigned int)(shift % 8);
+    total = length + (bits != 0);
+
+    for( copied = 0; copied < total; copied += run, pos = 0 )
+    {
+        run = total - copied;
+
+        if( run > key->length - pos )
+            run = (unsigned int)(key->length - pos);
+
+        memcpy( slice + copied, key->data + pos, run );
+    }
+
+    if( bits != 0 )
+    {
+        encrypt_kernels.rotate_bits(slice, total, bits);
+    }
+}
+
+static inline void encrypt_prefetch(const unsigned char* address, unsigned int length)
+{
+    unsigned int offset = 0;
+
+    for( offset = 0; offset < length; offset += 64 )
+    {
+        __builtin_prefetch( address + offset, 0, 2 );
+    }
+}
+
+//
+// Blocks of tiled keys are processed ENCRYPT_TILE_SIZE bytes at a time. The rotated key for a
+// tile is built into the worker's tile buffer from the base key just before it is XORed in, so
+// both stay in L2 and the block is streamed only once. While the current tile is XORed the next
+// tile of the block and the key bytes it starts from are prefetched. The origin is the rotation
+// of the key for the first byte of the range.
+//
+static void encrypt_block_tiled(const encrypt_key_t* key, unsigned char* block, unsigned int length, unsigned long long origin, unsigned char* tile)
+{
+    unsigned int offset = 0, run = 0, next = 0;
+    unsigned long long shift = 0, pos = 0;
+
+    assert( key != NULL && block != NULL && tile != NULL );
+
+    for( offset = 0; offset < length; offset += run )
+    {
+        run = length - offset;
+
+        if( run > ENCRYPT_TILE_SIZE )
+            run = ENCRYPT_TILE_SIZE;
+
+        shift = origin + (unsigned long long)offset * 8;
+        encrypt_key_slice(key, shift, tile, run);
+
+        if( offset + run < length )
+        {
+            next = length - offset - run;
+
+            if( next > ENCRYPT_TILE_SIZE )
+                next = ENCRYPT_TILE_SIZE;
+
+            pos = (shift / 8 + run) % key->length;
+
+            encrypt_prefetch(block + offset + run, next);
+            encrypt_prefetch(key->data + pos, next < key->length - pos ? next : (unsigned int)(key->length - pos));
+        }
+
+        key->kernels.xor_block(block + offset, tile, run);
+    }
+}
+
+//
+// Encrypts a range of the input at the given stream offset that does not cross a block
+// boundary, either a whole block or a part of one. Byte j of block i is XORed with the key
+// bits starting at 8*j + i, so the range needs the key rotated by that amount for its first
+// byte and the rest follows contiguously from the rotated key.
+//
+static void encrypt_block_range(const encrypt_key_t* key, unsigned char* block, unsigned int length, unsigned long long offset, unsigned char* tile)
+{
+    unsigned long long shift = 0;
+
+    assert( key != NULL && block != NULL );
+    assert( offset % key->length + length <= key->length );
+
+    shift = encrypt_key_shift(key, offset);
+
+    if( key->schedule != NULL )
+    {
+        encrypt_block(key, block, length, encrypt_key_rotated(key, shift));
+    }
+    else if( key->tiled && tile != NULL )
+    {
+        encrypt_block_tiled(key, block, length, shift, tile);
+    }
+    else
+    {
+        encrypt_block_rotated(block, length, key->data, key->length, shift);
+    }
+}
+
+//
+// Encrypts a range of the input at the given stream offset that may span any number of blocks,
+// each piece at the rotation of the key for its own block, so a buffer of many blocks is done
+// in place against the schedule or the base key without a rotated copy of the key.
+//
+static void encrypt_blocks_range(const encrypt_key_t* key, unsigned char* block, unsigned int length, unsigned long long offset, unsigned char* tile)
+{
+    unsigned int run = 0;
+
+    for( ; length > 0; block += run, offset += run, length -= run )
+    {
+        run = length;
+
+        if( run > key->length - offset % key->length )
+            run = (unsigned int)(key->length - offset % key->length);
+
+        encrypt_block_range(key, block, run, offset, tile);
+    }
+}
+
+//
+// The length of the keystream of the key that is contiguous in memory from the stream offset:
+// up to the end of the pad, or else up to the end of the block.
+//
+static unsigned long long encrypt_key_run(const encrypt_key_t* key, unsigned long long offset)
+{
+    if( key->pad != NULL )
+        return key->padlength - offset % key->padlength;
+
+    return key->length - offset % key->length;
+}
+
+//
+// Returns the keystream of the key for length bytes from the stream offset, which must not run
+// past encrypt_key_run. It is read in place from the pad or the schedule, otherwise the rotated
+// key is built into the slice, which needs room for length + 1 bytes.
+//
+static const unsigned char* encrypt_key_stream(const encrypt_key_t* key, unsigned long long offset, unsigned int length, unsigned char* slice)
+{
+    size_t pos = 0, region = 0;
+
+    if( key->pad != NULL )
+    {
+        pos = (size_t)(offset % key->padlength);
+
+        for( region = pos / ENCRYPT_STREAM_CHUNK; region <= (pos + length - 1) / ENCRYPT_STREAM_CHUNK; region++ )
+        {
+            encrypt_parts_build(key, &key->regions, (unsigned int) region, encrypt_pad_region_build);
+        }
+
+        return key->pad + pos;
+    }
+
+    if( key->schedule != NULL )
+        return encrypt_key_rotated(key, encrypt_key_shift(key, offset));
+
+    encrypt_key_slice(key, encrypt_key_shift(key, offset), slice, length);
+    return slice;
+}
+
+//
+// Applies several keys to a range of the input in one pass, each key with its own block size.
+// The range is walked in runs that end at the nearest pad or block end of any key, and at most
+// a tile long, so that every key has its keystream for the run contiguous in memory; the
+// cascade kernel then XORs them all into the run at once. Keys without a schedule or pad build
+// their slice in their own ENCRYPT_TILE_SIZE + 1 bytes of the scratch buffer, without scratch
+// they are applied on their own with the fused rotation.
+//
+static void encrypt_cascade_range(const encrypt_key_t* keys, unsigned int keycount, unsigned char* block, unsigned int length, unsigned long long offset, unsigned char* scratch)
+{
+    const unsigned char* streams[ENCRYPT_KEY_LIMIT];
+    unsigned int key = 0, count = 0, run = 0;
+
+    assert( keys != NULL && keycount <= ENCRYPT_KEY_LIMIT );
+
+    for( ; length > 0; block += run, offset += run, length -= run )
+    {
+        run = length < ENCRYPT_TILE_SIZE ? length : ENCRYPT_TILE_SIZE;
+
+        for( key = 0; key < keycount; key++ )
+        {
+            if( encrypt_key_run(&keys[key], offset) < run )
+                run = (unsigned int) encrypt_key_run(&keys[key], offset);
+        }
+
+        for( key = 0, count = 0; key < keycount; key++ )
+        {
+            if( keys[key].pad == NULL && keys[key].schedule == NULL && scratch == NULL )
+            {
+                encrypt_block_range(&keys[key], block, run, offset, NULL);
+                continue;
+            }
+
+            streams[count++] = encrypt_key_stream(&keys[key], offset, run, scratch + (size_t) key * (ENCRYPT_TILE_SIZE + 1));
+        }
+
+        encrypt_kernels.xor_cascade(block, streams, count, run);
+    }
+}
+
+static void encrypt_item_range(const encrypt_key_t* keys, unsigned int keycount, encrypt_block_info_t* info, unsigned int pos, unsigned int length, const unsigned char* keystream, unsigned char* tile)
+{
+    const encrypt_key_t* key = keys;
+    unsigned char* block = info->block + pos;
+    unsigned long long offset = info->offset + pos;
+
+    if( keycount > 1 )
+    {
+        if( info->hole )
+            memset( block, 0, length );
+
+        encrypt_cascade_range(keys, keycount, block, length, offset, tile);
+    }
+    else if( keystream != NULL && info->hole )
+    {
+        memcpy( block, keystream + pos, length );
+    }
+    else if( keystream != NULL )
+    {
+        encrypt_block(key, block, length, keystream + pos);
+    }
+    else if( info->hole )
+    {
+        encrypt_keystream_copy(key, offset, block, length);
+    }
+    else if( key->pad != NULL )
+    {
+        encrypt_pad_apply(key, offset, block, length);
+    }
+    else
+    {
+        encrypt_blocks_range(key, block, length, offset, tile);
+    }
+}
+
+//
+// The sidecar lists the checksums of records of ENCRYPT_CRC_RECORD bytes at fixed stream
+// offsets, so it reads the same whatever the engine and the sizes of its blocks. Runs the
+// CRC32C of the input, side 0, or the output, side 1, over the bytes at pos in the block and
+// stores the CRC of every record ending within them, then starts afresh for the next record.
+// Blocks only carry record CRCs when checksums are on, without them nothing is done.
+//
+static uint32_t encrypt_checksum_update(encrypt_block_info_t* info, unsigned int side, uint32_t crc, const unsigned char* data, unsigned int pos, unsigned int length)
+{
+    unsigned int run = 0;
+    unsigned long long offset = 0;
+
+    if( info->crcs == NULL )
+        return crc;
+
+    for( ; length > 0; data += run, pos += run, length -= run )
+    {
+        offset = info->offset + pos;
+        run = ENCRYPT_CRC_RECORD - (unsigned int)(offset % ENCRYPT_CRC_RECORD);
+
+        if( run > length )
+            run = length;
+
+        crc = encrypt_kernels.crc32c(crc, data, run);
+
+        if( (offset + run) % ENCRYPT_CRC_RECORD == 0 || pos + run == info->length )
+        {
+            info->crcs[(offset / ENCRYPT_CRC_RECORD - info->offset / ENCRYPT_CRC_RECORD) * 2 + side] = ~crc;
+            crc = ~0u;
+        }
+    }
+
+    return crc;
+}
+
+//
+// Encrypts a work item, against the keystream for the whole item when the caller has it or
+// else from the item's stream offset. With checksums on the item is done in chunks small enough
+// to stay in L1, each one checksummed as input, encrypted and checksummed as output in turn,
+// so the data comes in from memory only once. Holes are checksummed as the zeros they read as.
+// Several keys are applied in cascade, with the tile as the scratch for their slices.
+//
+static void encrypt_item(const encrypt_key_t* keys, unsigned int keycount, encrypt_block_info_t* info, const unsigned char* keystream, unsigned char* tile, unsigned char checksum)
+{
+    static const unsigned char zeros[ENCRYPT_CRC_CHUNK];
+    unsigned int pos = 0, run = 0;
+    uint32_t input = ~0u, output = ~0u;
+
+    assert( keys != NULL && keycount > 0 && info != NULL );
+
+    if( !checksum )
+    {
+        encrypt_item_range(keys, keycount, info, 0, info->length, keystream, tile);
+        return;
+    }
+
+    for( pos = 0; pos < info->length; pos += run )
+    {
+        run = info->length - pos;
+
+        if( run > ENCRYPT_CRC_CHUNK )
+            run = ENCRYPT_CRC_CHUNK;
+
+        input = encrypt_checksum_update(info, 0, input, info->hole ? zeros : info->block + pos, pos, run);
+        encrypt_item_range(keys, keycount, info, pos, run, keystream, tile);
+        output = encrypt_checksum_update(info, 1, output, info->block + pos, pos, run);
+    }
+}
+
+//
+// The process queue is a bounded ring that any number of threads can enqueue to and dequeue
+// from without a lock. Every cell carries a sequence number telling whose turn it is: a cell at
+// position p is free for the enqueuer at p when it reads p, and holds a block for the dequeuer
+// at p when it reads p + 1. Threads claim a position by advancing the tail or head with a
+// compare and swap and then publish the cell by moving its sequence on, the enqueuer to p + 1
+// and the dequeuer to the position of the next round, p + capacity.
+//
+static int encrypt_ring_push(encrypt_ring_t* ring, encrypt_block_info_t* info)
+{
+    encrypt_ring_cell_t* cell = NULL;
+    unsigned long long position = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    long long turn = 0;
+
+    for( ;; )
+    {
+        cell = &ring->cells[position & ring->mask];
+        turn = (long long)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - position);
+
+        if( turn == 0 )
+        {
+            if( __atomic_compare_exchange_n(&ring->tail, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+                break;
+        }
+        else if( turn < 0 )
+        {
+            return -1;
+        }
+        else
+        {
+            position = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->info = info;
+    __atomic_store_n( &cell->sequence, position + 1, __ATOMIC_RELEASE );
+
+    return 0;
+}
+
+static encrypt_block_info_t* encrypt_ring_pop(encrypt_ring_t* ring)
+{
+    encrypt_ring_cell_t* cell = NULL;
+    encrypt_block_info_t* info = NULL;
+    unsigned long long position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    long long turn = 0;
+
+    for( ;; )
+    {
+        cell = &ring->cells[position & ring->mask];
+        turn = (long long)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (position + 1));
+
+        if( turn == 0 )
+        {
+            if( __atomic_compare_exchange_n(&ring->head, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+                break;
+        }
+        else if( turn < 0 )
+        {
+            return NULL;
+        }
+        else
+        {
+            position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    info = cell->info;
+    __atomic_store_n( &cell->sequence, position + ring->mask + 1, __ATOMIC_RELEASE );
+
+    return info;
+}
+
+//
+// Keystream producers precompute the rotated key for upcoming work items into a ring of slots,
+// ahead of the workers that XOR them in. The items are laid out deterministically, each block
+// in parts of blocklength bytes, so the stream offset and length of an item follow from its
+// sequence number and the producers never need to see the input. Slots are handed out in
+// sequence order under the lock, item n using slot n % depth once item n - depth has released
+// it, so a producer running ahead can never overwrite a slot that is still to be consumed.
+//
+static void* encrypt_keystream_thread(void* arg)
+{
+    encrypt_context_t* context = (encrypt_context_t*)arg;
+    encrypt_keystream_t* keystream = NULL;
+    const encrypt_key_t* key = NULL;
+    unsigned int slot = 0, length = 0;
+    unsigned long long sequence = 0, parts = 0, part = 0, offset = 0;
+
+    assert(context != NULL);
+
+    keystream = &context->keystream;
+    key = context->key;
+    parts = (key->length + keystream->blocklength - 1) / keystream->blocklength;
+
+    while( !context->quit )
+    {
+        pthread_mutex_lock( &keystream->lock );
+
+        sequence = keystream->next++;
+        slot = (unsigned int)(sequence % keystream->depth);
+        sem_wait( &keystream->vacant[slot] );
+
+        pthread_mutex_unlock( &keystream->lock );
+
+        if( context->quit )
+            break;
+
+        part = sequence % parts;
+        offset = sequence / parts * key->length + part * keystream->blocklength;
+
+        length = keystream->blocklength;
+
+        if( length > key->length - part * keystream->blocklength )
+            length = (unsigned int)(key->length - part * keystream->blocklength);
+
+        encrypt_key_slice(key,
+                          encrypt_key_shift(key, offset),
+                          keystream->slots + (size_t)slot * keystream->slotlength,
+                          length);
+
+        sem_post( &keystream->ready[slot] );
+    }
+
+    pthread_exit(NULL);
+    return NULL;
+}
+
+static void encrypt_keystream_consume(encrypt_context_t* context, encrypt_block_info_t* info)
+{
+    encrypt_keystream_t* keystream = &context->keystream;
+    unsigned int slot = (unsigned int)(info->index % keystream->depth);
+    unsigned char* slice = keystream->slots + (size_t)slot * keystream->slotlength;
+
+    sem_wait( &keystream->ready[slot] );
+
+    encrypt_item(context->key, 1, info, slice, NULL, context->checksum);
+
+    sem_post( &keystream->vacant[slot] );
+}
+
+//
+// Every worker has a process ring of its own, which the main thread deals blocks into in turn.
+// A worker pops from its own ring, where only the main thread and itself normally touch the
+// head and tail, and steals from the rings of the other workers in turn only once its own is
+// empty, so that fast cores keep busy while a slow or preempted one still has blocks queued.
+// A thief takes the head of the victim's ring, the oldest block queued there.
+//
+static encrypt_block_info_t* encrypt_work_take(encrypt_context_t* context, unsigned int worker)
+{
+    encrypt_block_info_t* info = NULL;
+    unsigned int victim = 0;
+
+    if( (info = encrypt_ring_pop(&context->process_queues[worker])) != NULL )
+        return info;
+
+    for( victim = 1; victim < context->threadcount; victim++ )
+    {
+        if( (info = encrypt_ring_pop(&context->process_queues[(worker + victim) % context->threadcount])) != NULL )
+            break;
+    }
+
+    return info;
+}
+
+//
+// Worker threads wait for process event from the main thread to signal event for processing.
+// All workers wait on the one event, which counts the blocks queued across every process ring,
+// so a post is never lost on a busy worker: whichever worker wakes takes a block from its own
+// ring or, with that empty, steals one from another worker's. The worker performs the
+// encryption against the shared key schedule, reading it at the rotation for the block index.
+// Workers on tiled keys keep a tile buffer of their own and fall back to the fused rotation
+// without it, as do workers applying several keys, with a tile for each key.
+// With keystream producers running the rotated key is instead taken from the keystream ring.
+// Blocks read from holes in the input are not XORed but filled with the keystream.
+// Then when completed the worker publishes the encrypted block in its slot of the completion
+// window, without a lock since no other block in flight shares the slot, and signals back to
+// the writer thread about the completion of the encryption.
+//
+static void* encrypt_thread(void* arg)
+{
+    encrypt_context_t* context = (encrypt_context_t*)arg;
+    encrypt_block_info_t* info = NULL;
+    unsigned char* tile = NULL;
+    unsigned int worker = 0;
+
+    assert(context != NULL);
+
+    worker = __atomic_fetch_add(&context->nextworker, 1, __ATOMIC_RELAXED);
+
+    if( context->keycount > 1 )
+    {
+        tile = (unsigned char*) malloc( (size_t) context->keycount * (ENCRYPT_TILE_SIZE + 1) );
+    }
+    else if( context->key->tiled )
+    {
+        tile = (unsigned char*) malloc( ENCRYPT_TILE_SIZE + 1 );
+    }
+
+    while( !context->quit )
+    {
+        info = NULL;
+
+        if( sem_wait(&context->process_event) != 0 )
+            break;
+
+        if( context->quit )
+            break;
+
+        while( (info = encrypt_work_take(context, worker)) == NULL && !context->quit )
+        {
+            sched_yield();
+        }
+
+        if( info == NULL )
+            continue;
+
+        if( context->keystream.depth > 0 )
+        {
+            encrypt_keystream_consume(context, info);
+        }
+        else
+        {
+            encrypt_item(context->key,
+                         context->keycount,
+                         info,
+                         NULL,
+                         tile,
+                         context->checksum);
+        }
+
+        __atomic_store_n( &context->completion_window[info->index % context->windowsize], info, __ATOMIC_RELEASE );
+
+        sem_post( &context->completion_event );
+    }
+
+    safe_free( tile );
+    pthread_exit(NULL);
+    return NULL;
+}
+
+//
+// The writer thread waits for completion events from the workers and writes out every block
+// completed in order from the completion window, taking no lock while it writes. Each block
+// written frees a slot of the window for the main thread to read the next block into. It is
+// done once the main thread has published the number of blocks read and all are written.
+//
+static void* encrypt_writer_thread(void* arg)
+{
+    encrypt_context_t* context = (encrypt_context_t*)arg;
+    encrypt_block_info_t* info = NULL;
+    unsigned long long written = 0;
+
+    assert(context != NULL);
+
+    for( ;; )
+    {
+        while( (info = __atomic_load_n(&context->completion_window[written % context->windowsize], __ATOMIC_ACQUIRE)) != NULL )
+        {
+            context->completion_window[written++ % context->windowsize] = NULL;
+
+            fwrite(info->block, 1, info->length, stdout);
+            encrypt_checksum_add(context->stats, info);
+            context->stats->bytes += info->length;
+            encrypt_block_deinit( info );
+
+            sem_post( &context->window_event );
+        }
+
+        if( __atomic_load_n(&context->blockcount, __ATOMIC_ACQUIRE) == written )
+            break;
+
+        if( sem_wait(&context->completion_event) != 0 || context->quit )
+            break;
+    }
+
+    pthread_exit(NULL);
+    return NULL;
+}
+
+static int encrypt_block_init(encrypt_block_info_t** blockinfo, unsigned long long blockindex, unsigned int blocklength, unsigned char checksum)
+{
+    int retval = 0;
+    encrypt_block_info_t* info = NULL;
+
+    assert( blockinfo != NULL );
+    assert( blocklength > 0 );
+
+    *blockinfo = NULL;
+
+    verify_bool( (info = (encrypt_block_info_t*) malloc( sizeof(encrypt_block_info_t) )) != NULL );
+
+    memset( info, 0, sizeof(encrypt_block_info_t) );
+    info->index = blockindex;
+
+    verify_bool( (info->block = (unsigned char*) malloc( blocklength )) != NULL );
+
+    if( checksum )
+    {
+        verify_bool( (info->crcs = (uint32_t*) malloc( sizeof(uint32_t) * 2 * (blocklength / ENCRYPT_CRC_RECORD + 2) )) != NULL );
+    }
+
+    info->length = blocklength;
+
+    *blockinfo = info;
+    info = NULL;
+
+exit:
+    encrypt_block_deinit( info );
+    return retval;
+}
+
+static void encrypt_block_deinit(encrypt_block_info_t* info)
+{
+    int retval = 0;
+
+    verify_bool_quiet( info != NULL );
+
+    safe_free( info->crcs );
+    safe_free( info->block );
+    safe_free( info );
+
+exit:
+    return;
+}
+
+//
+// The ring gets the smallest power of two of cells holding the capacity, each cell starting
+// out free for the enqueuer at its own position.
+//
+static int encrypt_ring_init(encrypt_ring_t* ring, unsigned int capacity)
+{
+    int retval = 0;
+    unsigned long long count = 1, index = 0;
+
+    while( count < capacity )
+        count <<= 1;
+
+    verify_bool( (ring->cells = (encrypt_ring_cell_t*) malloc( sizeof(encrypt_ring_cell_t) * count )) != NULL );
+
+    for( index = 0; index < count; index++ )
+    {
+        ring->cells[index].sequence = index;
+        ring->cells[index].info = NULL;
+    }
+
+    ring->mask = count - 1;
+    ring->head = 0;
+    ring->tail = 0;
+
+exit:
+    return retval;
+}
+
+static void encrypt_ring_deinit(encrypt_ring_t* ring)
+{
+    encrypt_block_info_t* info = NULL;
+
+    if( ring->cells == NULL )
+        return;
+
+    while( (info = encrypt_ring_pop(ring)) != NULL )
+    {
+        encrypt_block_deinit( info );
+    }
+
+    safe_free( ring->cells );
+}
+
+//
+// The ring holds two slots per worker so that the producers can fill the next round of items
+// while the workers are still consuming the current one, and no fewer slots than the blocks in
+// flight so that no two items in the pipeline ever share a slot.
+//
+static int encrypt_keystream_init(encrypt_context_t* context, unsigned int producercount, unsigned int blocklength)
+{
+    int retval = 0;
+    unsigned int index = 0, depth = 0;
+    encrypt_keystream_t* keystream = &context->keystream;
+    pthread_t thread;
+
+    depth = context->threadcount * 2;
+
+    if( depth < context->windowsize )
+        depth = context->windowsize;
+
+    keystream->blocklength = blocklength;
+    keystream->slotlength = blocklength + 1;
+
+    verify_bool( (keystream->slots = (unsigned char*) malloc( (size_t)depth * keystream->slotlength )) != NULL );
+    verify_bool( (keystream->ready = (sem_t*) malloc( sizeof(sem_t) * depth )) != NULL );
+    verify_bool( (keystream->vacant = (sem_t*) malloc( sizeof(sem_t) * depth )) != NULL );
+    verify_bool( (keystream->threads = (pthread_t*) malloc( sizeof(pthread_t) * producercount )) != NULL );
+
+    verify( pthread_mutex_init(&keystream->lock, NULL) );
+
+    for( index = 0; index < depth; index++ )
+    {
+        sem_init( &keystream->ready[index], 0, 0 );
+        sem_init( &keystream->vacant[index], 0, 1 );
+    }
+
+    keystream->depth = depth;
+
+    for( index = 0; index < producercount; index++ )
+    {
+        verify( pthread_create(&thread,
+                               NULL,
+                               encrypt_keystream_thread,
+                               (void*) context) );
+
+        keystream->threads[keystream->threadcount++] = thread;
+    }
+
+exit:
+    return retval;
+}
+
+//
+// Called once the workers are joined. Producers waiting for a slot are woken up with one post
+// per producer on every slot, they see the quit flag and leave.
+//
+static void encrypt_keystream_deinit(encrypt_context_t* context)
+{
+    unsigned int index = 0, producer = 0;
+    encrypt_keystream_t* keystream = NULL;
+
+    if( context == NULL )
+        return;
+
+    keystream = &context->keystream;
+
+    if( keystream->depth > 0 )
+    {
+        for( index = 0; index < keystream->depth; index++ )
+        {
+            for( producer = 0; producer < keystream->threadcount; producer++ )
+            {
+                sem_post( &keystream->vacant[index] );
+            }
+        }
+
+        for( index = 0; index < keystream->threadcount; index++ )
+        {
+            pthread_join( keystream->threads[index], NULL );
+        }
+
+        for( index = 0; index < keystream->depth; index++ )
+        {
+            sem_destroy( &keystream->ready[index] );
+            sem_destroy( &keystream->vacant[index] );
+        }
+
+        pthread_mutex_destroy( &keystream->lock );
+    }
+
+    safe_free( keystream->threads );
+    safe_free( keystream->vacant );
+    safe_free( keystream->ready );
+    safe_free( keystream->slots );
+}
+
+static int encrypt_context_init(encrypt_context_t* context, const encrypt_key_t* keys, unsigned int keycount, unsigned int threadcount, unsigned int producercount, unsigned int windowsize, unsigned int blocklength)
+{
+    int retval = 0;
+    unsigned int index = 0;
+
+    context->key = keys;
+    context->keycount = keycount;
+
+    verify( sem_init(&context->process_event, 0, 0) );
+    verify( sem_init(&context->completion_event, 0, 0) );
+    verify( sem_init(&context->window_event, 0, windowsize) );
+
+    verify_bool( (context->completion_window = (encrypt_block_info_t**) malloc( sizeof(encrypt_block_info_t*) * windowsize )) != NULL );
+
+    context->windowsize = windowsize;
+    memset( context->completion_window, 0, sizeof(encrypt_block_info_t*) * windowsize );
+
+    verify_bool( (context->threads = (pthread_t*) malloc( sizeof(pthread_t) * threadcount )) != NULL );
+
+    context->threadcount = threadcount;
+    memset( context->threads, 0, sizeof(pthread_t) * threadcount );
+
+    verify( posix_memalign((void**) &context->process_queues, 64, sizeof(encrypt_ring_t) * threadcount) );
+    memset( context->process_queues, 0, sizeof(encrypt_ring_t) * threadcount );
+
+    for( index = 0; index < threadcount; index++ )
+    {
+        verify( encrypt_ring_init(&context->process_queues[index], windowsize) );
+    }
+
+    if( producercount > 0 )
+    {
+        verify( encrypt_keystream_init(context, producercount, blocklength) );
+    }
+
+    for( index = 0; index < context->threadcount; index++ )
+    {
+        verify( pthread_create(&context->threads[index],
+                               NULL,
+                               encrypt_thread,
+                               (void*) context) );
+    }
+
+    context->blockcount = ULLONG_MAX;
+
+    verify( pthread_create(&context->writer,
+                           NULL,
+                           encrypt_writer_thread,
+                           (void*) context) );
+
+    context->writing = 1;
+
+exit:
+    return retval;
+}
+
+//
+// Once all blocks are read the main thread publishes their number and waits for the writer to
+// have written them all out.
+//
+static void encrypt_context_finish(encrypt_context_t* context, unsigned long long blockcount)
+{
+    __atomic_store_n( &context->blockcount, blockcount, __ATOMIC_RELEASE );
+    sem_post( &context->completion_event );
+
+    pthread_join( context->writer, NULL );
+    context->writing = 0;
+}
+
+static void encrypt_context_deinit(encrypt_context_t* context)
+{
+    int retval = 0;
+    unsigned int index = 0;
+
+    verify_bool_quiet( context != NULL );
+
+    context->quit = 1;
+
+    for( index = 0; index < context->threadcount; index++ )
+    {
+        sem_post( &context->process_event );
+    }
+
+    for( index = 0; index < context->keystream.depth; index++ )
+    {
+        sem_post( &context->keystream.ready[index] );
+    }
+
+    for( index = 0; index < context->threadcount; index++ )
+    {
+        pthread_join( context->threads[index], NULL );
+    }
+
+    if( context->writing )
+    {
+        sem_post( &context->completion_event );
+        pthread_join( context->writer, NULL );
+    }
+
+    encrypt_keystream_deinit( context );
+
+    for( index = 0; context->completion_window != NULL && index < context->windowsize; index++ )
+    {
+        encrypt_block_deinit( context->completion_window[index] );
+    }
+
+    for( index = 0; context->process_queues != NULL && index < context->threadcount; index++ )
+    {
+        encrypt_ring_deinit( &context->process_queues[index] );
+    }
+
+    sem_destroy( &context->window_event );
+    sem_destroy( &context->completion_event );
+    sem_destroy( &context->process_event );
+
+    safe_free( context->process_queues );
+    safe_free( context->completion_window );
+    safe_free( context->threads );
+
+exit:
+    return;
+}
+
+//
+// Regular files with fewer blocks allocated than their size have holes, which read as zeros.
+// Those are located with SEEK_HOLE and SEEK_DATA so that reads falling entirely within a hole
+// are skipped instead. Other inputs are read as they are. The stream may not be at the start
+// of the file, so stream offsets are taken from the position it is at when opened.
+//
+static void encrypt_input_init(encrypt_input_t* input, FILE* stream)
+{
+    struct stat info;
+    off_t base = 0;
+
+    memset( input, 0, sizeof(encrypt_input_t) );
+
+    input->stream = stream;
+
+#if defined(SEEK_HOLE) && defined(SEEK_DATA)
+    if( fstat(fileno(stream), &info) == 0 && S_ISREG(info.st_mode) &&
+        (unsigned long long) info.st_blocks * 512 < (unsigned long long) info.st_size &&
+        (base = ftello(stream)) >= 0 && base <= info.st_size )
+    {
+        input->sparse = 1;
+        input->base = (unsigned long long) base;
+        input->size = (unsigned long long)(info.st_size - base);
+    }
+#else
+    (void) info;
+    (void) base;
+#endif
+}
+
+//
+// Finds the next hole ending after the offset. The queries move the descriptor offset under
+// the stream buffer, so it is put back where it was afterwards.
+//
+static void encrypt_input_locate(encrypt_input_t* input)
+{
+#if defined(SEEK_HOLE) && defined(SEEK_DATA)
+    int fd = fileno(input->stream);
+    off_t position = 0, hole = 0, data = 0;
+
+    if( (position = lseek(fd, 0, SEEK_CUR)) < 0 ||
+        (hole = lseek(fd, (off_t)(input->base + input->offset), SEEK_HOLE)) < 0 )
+    {
+        input->sparse = 0;
+        return;
+    }
+
+    if( (unsigned long long) hole - input->base >= input->size )
+    {
+        input->holestart = input->holeend = ULLONG_MAX;
+    }
+    else
+    {
+        data = lseek(fd, hole, SEEK_DATA);
+
+        input->holestart = (unsigned long long) hole - input->base;
+        input->holeend = data < 0 ? input->size : (unsigned long long) data - input->base;
+    }
+
+    lseek( fd, position, SEEK_SET );
+#else
+    input->sparse = 0;
+#endif
+}
+
+//
+// Reads up to length bytes like fread. When the whole range lies in a hole nothing is read,
+// the stream is moved past it and hole is set, leaving the buffer for the caller to fill.
+//
+static size_t encrypt_input_read(encrypt_input_t* input, unsigned char* buffer, size_t length, unsigned char* hole)
+{
+    size_t count = 0;
+
+    *hole = 0;
+
+    if( input->sparse && input->offset >= input->holeend )
+    {
+        encrypt_input_locate(input);
+    }
+
+    if( input->sparse && input->offset >= input->holestart && input->offset < input->size )
+    {
+        count = length;
+
+        if( count > input->size - input->offset )
+            count = (size_t)(input->size - input->offset);
+
+        if( input->offset + count <= input->holeend &&
+            fseeko(input->stream, (off_t)(input->base + input->offset + count), SEEK_SET) == 0 )
+        {
+            *hole = 1;
+            input->offset += count;
+            return count;
+        }
+    }
+
+    count = fread(buffer, 1, length, input->stream);
+    input->offset += count;
+
+    return count;
+}
+
+//
+// Multiplies two polynomials modulo the CRC32C polynomial, in the bit reversed representation
+// where x^0 is the top bit. Neither may be zero.
+//
+static uint32_t encrypt_crc32c_multiply(uint32_t a, uint32_t b)
+{
+    uint32_t mask = 1u << 31, product = 0;
+
+    for( ;; )
+    {
+        if( a & mask )
+        {
+            product ^= b;
+
+            if( (a & (mask - 1)) == 0 )
+                break;
+        }
+
+        mask >>= 1;
+        b = b & 1 ? (b >> 1) ^ ENCRYPT_CRC_POLYNOMIAL : b >> 1;
+    }
+
+    return product;
+}
+
+//
+// The CRC32C of two pieces one after the other, from the CRC of each and the length of the
+// second. Appending length bytes multiplies the first CRC by x^(8*length), which is built up
+// from the powers x^8, x^16, x^32, ... by repeated squaring.
+//
+static uint32_t encrypt_crc32c_combine(uint32_t first, uint32_t second, unsigned long long length)
+{
+    uint32_t factor = 1u << 31, power = 1u << 23;
+
+    for( ; length > 0; length >>= 1 )
+    {
+        if( length & 1 )
+            factor = encrypt_crc32c_multiply(power, factor);
+
+        power = encrypt_crc32c_multiply(power, power);
+    }
+
+    return encrypt_crc32c_multiply(factor, first) ^ second;
+}
+
+//
+// Lists the open record in the sidecar, given the stream offset it ends at.
+//
+static void encrypt_checksum_flush(encrypt_stats_t* stats, unsigned long long end)
+{
+    if( stats->sidecar != NULL && stats->recordlength > 0 )
+    {
+        fprintf( stats->sidecar, "%llu %u %08x %08x\n", end - stats->recordlength, stats->recordlength, stats->record[0], stats->record[1] );
+    }
+
+    stats->record[0] = stats->record[1] = 0;
+    stats->recordlength = 0;
+}
+
+//
+// Blocks are written in stream order, so their checksums are folded into the totals and the
+// records of the sidecar in that order too, whatever order the workers finished them in. A
+// record split between blocks is joined up here and listed once its last part is in.
+//
+static void encrypt_checksum_add(encrypt_stats_t* stats, const encrypt_block_info_t* info)
+{
+    unsigned int pos = 0, run = 0;
+    unsigned long long offset = 0;
+    const uint32_t* crcs = info->crcs;
+
+    if( !stats->checksum || crcs == NULL )
+        return;
 
-        for( index = 0; index < keylength; index++ )
-        {
-            key[index] <<= 1;
+    for( pos = 0; pos < info->length; pos += run, crcs += 2 )
+    {
+        offset = info->offset + pos;
+        run = ENCRYPT_CRC_RECORD - (unsigned int)(offset % ENCRYPT_CRC_RECORD);
 
-            if( (index+1) >= keylength )
-                break;
+        if( run > info->length - pos )
+            run = info->length - pos;
 
-            key[index] |= (key[index+1] & 0x80) != 0 ? 0x1 : 0x0;
-        }
+        stats->crc[0] = encrypt_crc32c_combine(stats->crc[0], crcs[0], run);
+        stats->crc[1] = encrypt_crc32c_combine(stats->crc[1], crcs[1], run);
+        stats->record[0] = encrypt_crc32c_combine(stats->record[0], crcs[0], run);
+        stats->record[1] = encrypt_crc32c_combine(stats->record[1], crcs[1], run);
+        stats->recordlength += run;
 
-        key[keylength-1] |= carry ? 0x1 : 0x0;
+        if( (offset + run) % ENCRYPT_CRC_RECORD == 0 )
+            encrypt_checksum_flush(stats, offset + run);
     }
 }
 
-static unsigned int compute_gcd(unsigned int a, unsigned int b)
+//
+// Work items of the parallel engine are key-sized blocks by default, but not in every case.
+// A pad has no block boundaries, so keys with a pad are applied in stream chunks.
+// Several keys have no common block size, so they are applied in stream chunks like a pad.
+// Small keys without a pad are batched into superblocks, each item carrying as many whole
+// blocks as fit in a stream chunk, so that the allocation, queueing and signalling per item are
+// paid once per chunk rather than once per block. Keystream producers prepare one rotation per
+// block, so their keys keep single blocks.
+// Huge keys, where a window of whole blocks would hold more than ENCRYPT_SPLIT_THRESHOLD bytes,
+// have each block split into one part per worker so that all workers share every block. Parts
+// are cut shorter still where needed for the whole window to stay within the threshold, which
+// also keeps the items of keys over 4 GiB within the 32-bit item length.
+//
+static unsigned int encrypt_parallel_blocklength(const encrypt_key_t* key, unsigned int keycount, unsigned int threadcount, unsigned int producercount, unsigned int windowsize)
 {
-    if( b == 0 ) { return a; } return compute_gcd(b, a % b);
+    unsigned int windowlimit = 0;
+    unsigned long long partlength = 0;
+
+    if( key->pad != NULL || keycount > 1 )
+        return ENCRYPT_STREAM_CHUNK;
+
+    if( key->length < ENCRYPT_STREAM_CHUNK && producercount == 0 )
+        return (unsigned int)(ENCRYPT_STREAM_CHUNK - ENCRYPT_STREAM_CHUNK % key->length);
+
+    if( key->length * windowsize <= ENCRYPT_SPLIT_THRESHOLD )
+        return (unsigned int) key->length;
+
+    partlength = (key->length + threadcount - 1) / threadcount;
+    windowlimit = ENCRYPT_SPLIT_THRESHOLD / windowsize / ENCRYPT_TILE_SIZE * ENCRYPT_TILE_SIZE;
+
+    if( windowlimit < ENCRYPT_TILE_SIZE )
+        windowlimit = ENCRYPT_TILE_SIZE;
+
+    if( partlength > windowlimit )
+        partlength = windowlimit;
+
+    partlength = (partlength + ENCRYPT_TILE_SIZE - 1) / ENCRYPT_TILE_SIZE * ENCRYPT_TILE_SIZE;
+
+    return (unsigned int)(partlength < key->length ? partlength : key->length);
 }
 
-static void encrypt_rotate_key_bytes(unsigned char* key, unsigned int keylength, unsigned char shift)
+//
+// The main thread schedules each block read from the input stream to the worker threads as a
+// continuous pipeline. It keeps reading as long as fewer than windowsize blocks are in flight,
+// while the writer thread flushes the blocks completed in order to the output stream, so
+// reading, encryption and writing overlap and a slow block only holds up the blocks behind it
+// in the window. The main thread only reads and the writer only writes. The worker threads
+// compute the rotated key based on the block index and perform the xor transformation. The
+// worker thread and the main thread communicate using semaphore to signal.
+// Keys without a schedule or pad can have their rotations prepared by keystream producers
+// running ahead of the workers.
+//
+static int encrypt_execute_parallel(const encrypt_key_t* keys, unsigned int keycount, encrypt_input_t* input, unsigned int threadcount, unsigned int producercount, unsigned int windowsize, encrypt_stats_t* stats)
 {
-    unsigned int index = 0, pos = 0, gcd = 0;
-    unsigned char value = 0, next = 0;
+    const encrypt_key_t* key = keys;
+    int retval = 0;
+    unsigned int blocklength = 0, readlength = 0;
+    unsigned long long index = 0, offset = 0;
+    encrypt_context_t context;
+    encrypt_block_info_t* info = NULL;
 
-    assert( key != NULL );
-    assert( shift < keylength );
+    assert( key != NULL && key->length > 0 );
+    assert( threadcount > 0 && windowsize > 0 );
 
-    gcd = compute_gcd( shift, keylength );
+    blocklength = encrypt_parallel_blocklength(key, keycount, threadcount, producercount, windowsize);
 
-    for( index = 0; index < gcd; index++ )
+    memset( &context, 0, sizeof(encrypt_context_t) );
+    context.checksum = stats->checksum;
+    context.stats = stats;
+
+    verify( encrypt_context_init(&context, keys, keycount, threadcount, producercount, windowsize, blocklength) );
+
+    for( ;; index++ )
     {
-        value = key[index];
-        pos = index;
+        sem_wait( &context.window_event );
 
-        while( 1 )
-        {
-            next = pos + shift;
+        verify( encrypt_block_init(&info, index, blocklength, context.checksum) );
 
-            if( next >= keylength )
-                next = next - keylength;
+        readlength = blocklength;
 
-            if( next == index )
-                break;
+        if( key->pad == NULL && keycount == 1 && blocklength <= key->length && readlength > key->length - offset % key->length )
+            readlength = (unsigned int)(key->length - offset % key->length);
 
-            key[pos] = key[next];
-            pos = next;
+        if( (info->length = encrypt_input_read(input, info->block, readlength, &info->hole)) == 0 )
+        {
+            encrypt_block_deinit( info );
+            break;
         }
 
-        key[pos] = value;
+        info->offset = offset;
+        offset += info->length;
+
+        verify( encrypt_ring_push(&context.process_queues[index % threadcount], info) );
+        sem_post( &context.process_event );
     }
+
+    encrypt_context_finish( &context, index );
+
+exit:
+    encrypt_context_deinit( &context );
+    return retval;
 }
 
 //
-// To compute the rotated key, we do it in two phases. We first compute the byte
-// shift amount which corresponds to rotating elements in an array. We use Bentley's algorithm
-// to perform the shift inplace. The remaining shift amount which is less than 8 bits is done 
-// one left shift at a time. Note to improve performance we could perform key caching and save
-// computation for repetitive shift amounts since they are cyclic. This would make it performant
-// for large number of blocks with small key sizes but this hasn't yet been implemented.
+// The sequential engine streams the input in large buffers holding many blocks, or parts of
+// one for huge keys, and encrypts each buffer in place at its stream offset: against the pad,
+// against the schedule at the rotation of every block, or for tiled keys one tile of the
+// rotated key at a time. The rotation is only ever a virtual offset into the key, so there are
+// no per-block calls and no rotated copy of the key to maintain. Several keys are applied in
+// cascade, each in its own tile of the scratch buffer.
 //
-static void encrypt_rotate_key(unsigned char* key, unsigned int keylength, unsigned int shift)
+static int encrypt_execute_sequential(const encrypt_key_t* keys, unsigned int keycount, encrypt_input_t* input, encrypt_stats_t* stats)
 {
-    shift = shift % (keylength * 8);
+    int retval = 0;
+    unsigned long long offset = 0;
+    unsigned char* scratch = NULL;
+    const encrypt_key_t* key = keys;
+    encrypt_block_info_t* info = NULL;
 
-    if( shift / 8 != 0 )
-    {
-        encrypt_rotate_key_bytes(key, keylength, shift / 8);
-    }
+    assert( key != NULL && key->length > 0 );
 
-    if( shift % 8 != 0 )
+    verify( encrypt_block_init(&info, 0, ENCRYPT_STREAM_CHUNK, stats->checksum) );
+
+    if( keycount > 1 || key->tiled )
     {
-        encrypt_rotate_key_bits(key, keylength, shift % 8);
+        verify_bool( (scratch = (unsigned char*) malloc( (size_t) keycount * (ENCRYPT_TILE_SIZE + 1) )) != NULL );
     }
-}
 
-static void encrypt_block(unsigned char* block, unsigned int length, unsigned char* key, unsigned int keylength)
-{
-    unsigned int index = 0;
-
-    assert( block != NULL );
-    assert( key != NULL && length <= keylength );
-
-    for( index = 0; index < length; index++ )
+    while( (info->length = encrypt_input_read(input, info->block, ENCRYPT_STREAM_CHUNK, &info->hole)) > 0 )
     {
-        block[index] = block[index] ^ key[index];
+        info->offset = offset;
+        encrypt_item(keys, keycount, info, NULL, scratch, stats->checksum);
+
+        fwrite(info->block, 1, info->length, stdout);
+        encrypt_checksum_add(stats, info);
+        stats->bytes += info->length;
+        offset += info->length;
     }
+
+exit:
+    safe_free( scratch );
+    encrypt_block_deinit( info );
+    return retval;
 }
 
 //
-// Worker threads wait for process event from the main thread to signal event for processing.
-// The worker then dequeues one block from the process queue and performs the encryption.
-// Then when completed the worker enqueues the encrypted block to the completion queue and
-// signals back to the worker about the completion of the encryption.
+// The register engine reads the input in buffers holding a whole number of blocks and runs
+// them straight through the limbs, without block descriptors, schedule or pad lookups. It
+// needs no memory for the key, so it serves small keys when the pad is over the budget; a pad
+// in cache still streams faster since it has no per-block work at all. Holes in the input are
+// not read, the limbs generate the keystream into a zeroed buffer instead. Checksums are taken
+// in whole blocks of about ENCRYPT_CRC_CHUNK bytes, as in encrypt_item.
 //
-static void* encrypt_thread(void* arg)
+static int encrypt_execute_register(const encrypt_key_t* key, encrypt_input_t* input, encrypt_stats_t* stats)
 {
     int retval = 0;
-    unsigned char* key = NULL;
-    encrypt_context_t* context = (encrypt_context_t*)arg;
-    encrypt_block_info_t* info = NULL, *current = NULL, *previous = NULL;
+    unsigned int limb = 0, limbcount = 0;
+    size_t length = 0, chunk = 0, pos = 0, run = 0, crcchunk = 0;
+    uint32_t crc[2], crcs[2 * (ENCRYPT_STREAM_CHUNK / ENCRYPT_CRC_RECORD + 2)];
+    uint64_t limbs[8];
+    unsigned char* buffer = NULL;
+    encrypt_block_info_t info;
 
-    assert(context != NULL);
+    assert( key != NULL && key->length > 0 && key->length <= ENCRYPT_REGISTER_LIMIT );
 
-    verify_bool_quit( (key = (unsigned char*) malloc(context->keylength)) != NULL );
+    limbcount = (unsigned int)((key->length + 7) / 8);
 
-    while( !context->quit )
-    {
-        info = NULL;
+    memset( limbs, 0, sizeof(limbs) );
+    memcpy( limbs, key->data, key->length );
 
-        if( sem_wait(&context->process_event) != 0 )
-            break;
+    for( limb = 0; limb < limbcount; limb++ )
+    {
+        limbs[limb] = encrypt_be64(limbs[limb]);
+    }
 
-        if( context->quit )
-            break;
+    chunk = ENCRYPT_STREAM_CHUNK - ENCRYPT_STREAM_CHUNK % key->length;
 
-        pthread_mutex_lock( &context->queuelock );
+    verify_bool( (buffer = (unsigned char*) malloc(chunk)) != NULL );
 
-        if( context->process_queue != NULL )
-        {
-            info = context->process_queue;
-            context->process_queue = info->next;
-        }
+    memset( &info, 0, sizeof(encrypt_block_info_t) );
+    info.block = buffer;
+    info.crcs = crcs;
+    crcchunk = ENCRYPT_CRC_CHUNK - ENCRYPT_CRC_CHUNK % key->length;
 
-        pthread_mutex_unlock( &context->queuelock );
+    while( (length = encrypt_input_read(input, buffer, chunk, &info.hole)) > 0 )
+    {
+        if( info.hole )
+            memset( buffer, 0, length );
 
-        if( info == NULL )
-            continue;
+        info.length = (unsigned int) length;
+        crc[0] = crc[1] = ~0u;
 
-        memcpy(key, context->key, context->keylength);
-        encrypt_rotate_key(key, context->keylength, info->index);
+        for( pos = 0; pos < length; pos += run )
+        {
+            run = length - pos;
 
-        encrypt_block(info->block,
-                      info->length,
-                      key,
-                      context->keylength);
+            if( stats->checksum && run > crcchunk )
+                run = crcchunk;
 
-        pthread_mutex_lock( &context->queuelock );
+            if( stats->checksum )
+                crc[0] = encrypt_checksum_update(&info, 0, crc[0], buffer + pos, (unsigned int) pos, (unsigned int) run);
 
-        for( current = context->completion_queue, previous = current;
-             current != NULL;
-             current = current->next )
-        {
-            if( info->index < current->index )
-                break;
+            encrypt_kernels.register_blocks(limbs, limbcount, (unsigned int) key->length, buffer + pos, run);
 
-            previous = current;
+            if( stats->checksum )
+                crc[1] = encrypt_checksum_update(&info, 1, crc[1], buffer + pos, (unsigned int) pos, (unsigned int) run);
         }
 
-        if( context->completion_queue == NULL )
-            context->completion_queue = info;
-        else
-            previous->next = info;
-
-        info->next = current;
-        pthread_mutex_unlock( &context->queuelock );
+        fwrite(buffer, 1, length, stdout);
+        encrypt_checksum_add(stats, &info);
 
-        sem_post( &context->completion_event );
+        info.offset += length;
+        stats->bytes += length;
     }
 
-    pthread_exit(NULL);
-    return NULL;
+exit:
+    safe_free( buffer );
+    return retval;
 }
 
-static int encrypt_block_init(encrypt_block_info_t** blockinfo, unsigned int blockindex, unsigned int blocklength)
+static int encrypt_key_init(encrypt_key_t* key, char* keyfilename, size_t padlimit)
 {
     int retval = 0;
-    encrypt_block_info_t* info = NULL;
+    off_t keylength = 0;
+    FILE* keyfile = NULL;
 
-    assert( blockinfo != NULL );
-    assert( blocklength > 0 );
+    assert( key != NULL );
 
-    *blockinfo = NULL;
+    memset( key, 0, sizeof(encrypt_key_t) );
 
-    verify_bool( (info = (encrypt_block_info_t*) malloc( sizeof(encrypt_block_info_t) )) != NULL );
+    verify_bool( keyfilename != NULL );
+    verify_bool( (keyfile = fopen(keyfilename, "rb")) != NULL );
 
-    memset( info, 0, sizeof(encrypt_block_info_t) );
-    info->index = blockindex;
+    verify( fseeko(keyfile, 0, SEEK_END) );
+    verify_bool( (keylength = ftello(keyfile)) > 0 );
+    verify( fseeko(keyfile, 0, SEEK_SET) );
 
-    verify_bool( (info->block = (unsigned char*) malloc( blocklength )) != NULL );
+    key->length = (unsigned long long) keylength;
 
-    info->length = blocklength;
-    info->next = NULL;
+    verify_bool( (key->data = (unsigned char*) malloc(key->length)) );
+    verify_bool( fread(key->data, 1, key->length, keyfile) == key->length );
 
-    *blockinfo = info;
-    info = NULL;
+    verify( encrypt_key_schedule_init(key) );
+    verify( encrypt_key_pad_init(key, padlimit) );
 
 exit:
-    encrypt_block_deinit( info );
+    safe_fclose( keyfile );
     return retval;
 }
 
-static void encrypt_block_deinit(encrypt_block_info_t* info)
+static void encrypt_key_deinit(encrypt_key_t* key)
 {
-    int retval = 0;
+    if( key == NULL )
+        return;
 
-    verify_bool_quiet( info != NULL );
+    encrypt_parts_deinit( &key->regions );
+    encrypt_parts_deinit( &key->phases );
 
-    safe_free( info->block );
-    safe_free( info );
+    safe_free( key->pad );
+    safe_free( key->schedule );
+    safe_free( key->data );
+}
 
-exit:
-    return;
+//
+// Keystream producers are only run when asked for on the command line. Workers on keys without
+// a schedule or pad rotate tile-sized slices of the key themselves, which stay in cache, while
+// a producer writes a whole key-sized rotation that the worker then reads back from memory.
+// They are left out as well for keys with a schedule or pad and for several keys in cascade,
+// which build their own slices.
+//
+static unsigned int encrypt_producer_count(const encrypt_key_t* key, unsigned int keycount, const encrypt_options_t* options)
+{
+    if( options->producercount <= 0 || key->pad != NULL || key->schedule != NULL || keycount > 1 )
+        return 0;
+
+    return (unsigned int) options->producercount;
 }
 
-static int encrypt_context_init(encrypt_context_t* context, unsigned char* key, unsigned int keylength, unsigned int threadcount)
+//
+// Unless given on the command line the pipeline keeps two blocks in flight per worker, one
+// being encrypted and one read ahead and queued behind it.
+//
+static unsigned int encrypt_window_size(const encrypt_options_t* options)
 {
-    int retval = 0;
-    unsigned int index = 0;
+    if( options->windowsize > 0 )
+        return options->windowsize;
 
-    context->key = key;
-    context->keylength = keylength;
+    return options->threadcount * 2;
+}
 
-    verify( pthread_mutex_init(&context->queuelock, NULL) );
+//
+// Non-temporal stores take the output out of the cache, but every block is read straight back
+// by fwrite, so they have measured slower than regular stores at every input size and key
+// length. The streaming kernels are therefore only used on request.
+//
+static unsigned char encrypt_streaming_enabled(const encrypt_options_t* options)
+{
+    return encrypt_kernels.xor_stream != NULL && options->streaming;
+}
 
-    verify( sem_init(&context->process_event, 0, 0) );
-    verify( sem_init(&context->completion_event, 0, 0) );
+static double encrypt_clock(void)
+{
+    struct timespec now;
 
-    verify_bool( (context->threads = (pthread_t*) malloc( sizeof(pthread_t) * threadcount )) != NULL );
+    clock_gettime( CLOCK_MONOTONIC, &now );
 
-    context->threadcount = threadcount;
-    memset( context->threads, 0, sizeof(pthread_t) * threadcount );
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
 
-    for( index = 0; index < context->threadcount; index++ )
+//
+// A single run can only use one store path, so to put a number on the difference the stats
+// time both XOR kernels over a buffer well beyond the cache, against a key that fits in it.
+//
+static double encrypt_stats_calibrate(encrypt_xor_routine_t routine, unsigned char* buffer, const unsigned char* key, unsigned int keylength)
+{
+    size_t offset = 0;
+    double start = 0;
+
+    start = encrypt_clock();
+
+    for( offset = 0; offset + keylength <= ENCRYPT_CALIBRATION_SIZE; offset += keylength )
     {
-        verify( pthread_create(&context->threads[index],
-                               NULL,
-                               encrypt_thread,
-                               (void*) context) );
+        routine(buffer + offset, key, keylength);
     }
 
-exit:
-    return retval;
+    return ENCRYPT_CALIBRATION_SIZE / (encrypt_clock() - start) / (1024 * 1024);
 }
 
-static void encrypt_context_deinit(encrypt_context_t* context)
+static void encrypt_stats_report(const encrypt_stats_t* stats)
 {
-    int retval = 0;
-    unsigned int index = 0;
-    encrypt_block_info_t* current = NULL, *info = NULL;
+    double temporal = 0, streaming = 0;
+    unsigned char* buffer = NULL, *key = NULL;
+    const unsigned int keylength = 1024 * 1024;
 
-    verify_bool_quiet( context != NULL );
+    fprintf( stderr,
+             "encryptUtil: %llu bytes in %.3f s, %.1f MiB/s (%s kernels, %s stores)\n",
+             stats->bytes,
+             stats->seconds,
+             stats->seconds > 0 ? stats->bytes / stats->seconds / (1024 * 1024) : 0.0,
+             encrypt_kernels.name,
+             stats->streaming ? "non-temporal" : "temporal" );
 
-    context->quit = 1;
+    if( encrypt_kernels.xor_stream == NULL )
+        return;
 
-    for( index = 0; index < context->threadcount; index++ )
-    {
-        sem_post( &context->process_event );
-    }
+    buffer = (unsigned char*) malloc(ENCRYPT_CALIBRATION_SIZE);
+    key = (unsigned char*) malloc(keylength);
 
-    for( index = 0; index < context->threadcount; index++ )
+    if( buffer == NULL || key == NULL )
     {
-        pthread_join( context->threads[index], NULL );
+        safe_free( key );
+        safe_free( buffer );
+        return;
     }
 
-    for( current = context->completion_queue;
-         current != NULL; )
-    {
-        info = current;
-        current = current->next;
-        encrypt_block_deinit( info );
-    }
+    memset( buffer, 0x5a, ENCRYPT_CALIBRATION_SIZE );
+    memset( key, 0xa5, keylength );
 
-    for( current = context->process_queue;
-         current != NULL; )
-    {
-        info = current;
-        current = current->next;
-        encrypt_block_deinit( info );
-    }
+    temporal = encrypt_stats_calibrate(encrypt_kernels.xor_block, buffer, key, keylength);
+    streaming = encrypt_stats_calibrate(encrypt_kernels.xor_stream, buffer, key, keylength);
 
-    context->completion_queue = NULL;
-    context->process_queue = NULL;
+    fprintf( stderr,
+             "encryptUtil: store calibration %.1f MiB/s temporal, %.1f MiB/s non-temporal (%+.1f%%)\n",
+             temporal,
+             streaming,
+             (streaming - temporal) / temporal * 100 );
 
-    sem_destroy( &context->completion_event );
-    sem_destroy( &context->process_event );
+    safe_free( key );
+    safe_free( buffer );
+}
+
+static void encrypt_checksum_report(encrypt_stats_t* stats)
+{
+    encrypt_checksum_flush(stats, stats->bytes);
 
-    pthread_mutex_destroy( &context->queuelock );
+    fprintf( stderr,
+             "encryptUtil: crc32c input %08x output %08x over %llu bytes\n",
+             stats->crc[0],
+             stats->crc[1],
+             stats->bytes );
 
-exit:
-    return;
+    if( stats->sidecar != NULL )
+    {
+        fprintf( stats->sidecar, "total %llu %08x %08x\n", stats->bytes, stats->crc[0], stats->crc[1] );
+    }
 }
 
 //
-// The main thread schedules each block read from the input stream to the worker
-// thread. After N blocks are read and scheduled to the, worker thread to process
-// the blocks are flushed to the output stream in order and the process continues
-// until all blocks are read. The worker threads compute the rotated key based on
-// the block index and perform the xor transformation. The worker thread and the main
-// thread communicate using semaphore to signal.
+// A session holds the keys loaded for encryption, each with the schedule and pad it gets
+// within its share of the pad budget. Schedules and pads are built on first use.
 //
-static int encrypt_execute_parallel(unsigned char* key, unsigned int keylength, unsigned int threadcount)
+int encrypt_session_init(encrypt_session_t* session, char** keyfilenames, unsigned int keycount, size_t padlimit)
 {
     int retval = 0;
-    unsigned int index = 0, slot = 0;
-    unsigned char quit = 0;
-    encrypt_context_t context;
-    encrypt_block_info_t* info = NULL, *current = NULL;
-
-    assert( key != NULL && keylength > 0 );
-    assert( threadcount > 0 );
-
-    memset( &context, 0, sizeof(encrypt_context_t) );
-    verify( encrypt_context_init(&context, key, keylength, threadcount) );
-
-    while( !quit )
-    {
-        for( slot = 0; slot < threadcount; index++, slot++ )
-        {
-            verify( encrypt_block_init(&info, index, keylength) );
+    unsigned int index = 0;
 
-            if( (info->length = fread(info->block, 1, keylength, stdin)) == 0 )
-            {
-                encrypt_block_deinit( info );
-                quit = 1;
-                break;
-            }
+    verify_bool( session != NULL );
 
-            pthread_mutex_lock( &context.queuelock );
+    memset( session, 0, sizeof(encrypt_session_t) );
+    encrypt_kernels_init();
 
-            if( context.process_queue == NULL )
-                context.process_queue = info;
-            else
-            {
-                for( current = context.process_queue;
-                     current->next != NULL;
-                     current = current->next )
-                {}
+    verify_bool( keyfilenames != NULL );
+    verify_bool( keycount > 0 && keycount <= ENCRYPT_KEY_LIMIT );
+    verify_bool( (session->keys = (encrypt_key_t*) malloc( sizeof(encrypt_key_t) * keycount )) != NULL );
 
-                current->next = info;
-            }
+    memset( session->keys, 0, sizeof(encrypt_key_t) * keycount );
+    session->keycount = keycount;
 
-            pthread_mutex_unlock( &context.queuelock );
-            sem_post( &context.process_event );
-        }
+    for( index = 0; index < keycount; index++ )
+    {
+        verify( encrypt_key_init(&session->keys[index], keyfilenames[index], padlimit / keycount) );
+        encrypt_kernels_specialize(&session->keys[index].kernels, session->keys[index].length);
+    }
 
-        for( ; slot > 0; slot-- )
-        {
-            sem_wait( &context.completion_event );
-        }
+exit:
+    return retval;
+}
 
-        pthread_mutex_lock( &context.queuelock );
-        current = context.completion_queue;
+void encrypt_session_deinit(encrypt_session_t* session)
+{
+    unsigned int index = 0;
 
-        while( current != NULL )
-        {
-            info = current;
-            current = current->next;
-            fwrite(info->block, 1, info->length, stdout);
-            encrypt_block_deinit( info );
-        }
+    if( session == NULL || session->keys == NULL )
+        return;
 
-        context.completion_queue = NULL;
-        pthread_mutex_unlock( &context.queuelock );
+    for( index = 0; index < session->keycount; index++ )
+    {
+        encrypt_key_deinit( &session->keys[index] );
     }
 
-exit:
-    encrypt_context_deinit( &context );
-    return retval;
+    safe_free( session->keys );
+    session->keycount = 0;
 }
 
-static int encrypt_execute_sequential(unsigned char* key, unsigned int keylength)
+//
+// Encrypts, or decrypts, the buffer as the bytes at the given offset of the stream. The
+// keystream is a function of the stream offset alone, so any range can be done on its own in
+// time linear in its length, and the same session can serve several threads at once. Only
+// tiled keys and several keys need scratch for their slices, allocated for the call.
+//
+int encrypt_at(const encrypt_session_t* session, unsigned long long offset, unsigned char* buffer, size_t length)
 {
     int retval = 0;
-    unsigned int index = 0;
-    encrypt_block_info_t* info = NULL;
+    size_t pos = 0;
+    unsigned char* scratch = NULL;
+    encrypt_block_info_t info;
 
-    assert( key != NULL && keylength > 0 );
+    verify_bool( session != NULL && session->keys != NULL );
+    verify_bool( buffer != NULL || length == 0 );
 
-    verify( encrypt_block_init(&info, index, keylength) );
-
-    for( index = 0;; index++ )
+    if( session->keycount > 1 || session->keys->tiled )
     {
-        info->index = index;
+        verify_bool( (scratch = (unsigned char*) malloc( (size_t) session->keycount * (ENCRYPT_TILE_SIZE + 1) )) != NULL );
+    }
 
-        if( (info->length = fread(info->block, 1, keylength, stdin)) == 0 )
-        {
-            break;
-        }
+    memset( &info, 0, sizeof(encrypt_block_info_t) );
 
-        encrypt_block(info->block,
-                      info->length,
-                      key,
-                      keylength);
+    for( pos = 0; pos < length; pos += info.length )
+    {
+        info.block = buffer + pos;
+        info.offset = offset + pos;
+        info.length = length - pos < ENCRYPT_STREAM_CHUNK ? (unsigned int)(length - pos) : ENCRYPT_STREAM_CHUNK;
 
-        fwrite(info->block, 1, info->length, stdout);
-        encrypt_rotate_key(key, keylength, 1);
+        encrypt_item(session->keys, session->keycount, &info, NULL, scratch, 0);
     }
 
 exit:
-    encrypt_block_deinit( info );
+    safe_free( scratch );
     return retval;
 }
 
-int encrypt(char* keyfilename, unsigned int threadcount)
+//
+// Several keys are applied in cascade in a single pass, the output being the same as running
+// the input through each key in turn. The pad budget is shared evenly between the keys.
+//
+int encrypt(char** keyfilenames, unsigned int keycount, const encrypt_options_t* options)
 {
     int retval = 0;
-    unsigned int keylength = 0;
-    unsigned char* key = NULL;
-    FILE* keyfile = NULL;
+    double start = 0;
+    unsigned char registers = 0;
+    encrypt_session_t session;
+    encrypt_key_t* key = NULL;
+    encrypt_input_t input;
+    encrypt_stats_t stats;
 
-    verify_bool( keyfilename != NULL );
-    verify_bool( (keyfile = fopen(keyfilename, "rb")) != NULL );
+    memset( &session, 0, sizeof(encrypt_session_t) );
+    memset( &stats, 0, sizeof(encrypt_stats_t) );
+
+    verify_bool( options != NULL );
+    verify( encrypt_session_init(&session, keyfilenames, keycount, options->padlimit) );
+
+    key = session.keys;
+    registers = options->threadcount == 0 && keycount == 1 && key->pad == NULL && key->length <= ENCRYPT_REGISTER_LIMIT;
+
+    if( keycount == 1 && !registers && (stats.streaming = encrypt_streaming_enabled(options)) != 0 )
+    {
+        key->kernels.xor_block = key->kernels.xor_stream;
+    }
 
-    verify( fseek(keyfile, 0, SEEK_END) );
-    verify_bool( (keylength = ftell(keyfile)) > 0 );
-    verify( fseek(keyfile, 0, SEEK_SET) );
+    if( options->checksumfile != NULL )
+    {
+        stats.checksum = 1;
+        verify_bool( (stats.sidecar = fopen(options->checksumfile, "w")) != NULL );
+    }
 
-    verify_bool( (key = (unsigned char*) malloc(keylength)) );
-    verify_bool( fread(key, 1, keylength, keyfile) > 0 );
+    encrypt_input_init(&input, stdin);
+    start = encrypt_clock();
 
-    if( threadcount == 0 )
+    if( registers )
     {
-        verify( encrypt_execute_sequential(key, keylength) );
+        verify( encrypt_execute_register(key, &input, &stats) );
+    }
+    else if( options->threadcount == 0 )
+    {
+        verify( encrypt_execute_sequential(session.keys, keycount, &input, &stats) );
     }
     else
     {
-        verify( encrypt_execute_parallel(key, keylength, threadcount) );
+        verify( encrypt_execute_parallel(session.keys,
+                                         keycount,
+                                         &input,
+                                         options->threadcount,
+                                         encrypt_producer_count(key, keycount, options),
+                                         encrypt_window_size(options),
+                                         &stats) );
+    }
+
+    fflush( stdout );
+    stats.seconds = encrypt_clock() - start;
+
+    if( options->stats )
+    {
+        encrypt_stats_report( &stats );
+    }
+
+    if( stats.checksum )
+    {
+        encrypt_checksum_report( &stats );
     }
 
 exit:
-    safe_fclose( keyfile );
-    safe_free( key );
+    safe_fclose( stats.sidecar );
+    encrypt_session_deinit( &session );
 
     return retval;
 }
@@ -454,26 +2829,78 @@ void signal_handler(int signum)
     exit(signum);
 }
 
+//
+// Sizes on the command line are in bytes, optionally followed by a K, M or G multiplier.
+//
+static size_t parse_size(const char* text)
+{
+    char* suffix = NULL;
+    unsigned long long size = strtoull(text, &suffix, 10);
+
+    switch( *suffix )
+    {
+    case 'G': case 'g': size <<= 10; // fall through
+    case 'M': case 'm': size <<= 10; // fall through
+    case 'K': case 'k': size <<= 10; break;
+    }
+
+    return (size_t) size;
+}
+
 int main(int argc, char* argv[])
 {
     int index = 0;
-    unsigned int threadcount = 0;
-    char* keyfilename = NULL;
+    unsigned int keycount = 0;
+    char* keyfilenames[ENCRYPT_KEY_LIMIT];
+    encrypt_options_t options;
+
+    memset( &options, 0, sizeof(encrypt_options_t) );
+    options.padlimit = ENCRYPT_PAD_LIMIT;
 
     for( index = 1; index < argc; index++ )
     {
         if( strcmp(argv[index], "-n") == 0 && (index+1) < argc )
         {
-            threadcount = atoi(argv[++index]);
+            options.threadcount = atoi(argv[++index]);
+        }
+        else if( strcmp(argv[index], "-p") == 0 && (index+1) < argc )
+        {
+            options.producercount = atoi(argv[++index]);
+        }
+        else if( strcmp(argv[index], "-w") == 0 && (index+1) < argc )
+        {
+            options.windowsize = atoi(argv[++index]);
+        }
+        else if( strcmp(argv[index], "-m") == 0 && (index+1) < argc )
+        {
+            options.padlimit = parse_size(argv[++index]);
         }
         else if( strcmp(argv[index], "-k") == 0 && (index+1) < argc )
         {
-            keyfilename = argv[++index];
+            if( keycount == ENCRYPT_KEY_LIMIT )
+            {
+                fprintf( stderr, "at most %u keys can be given\n", ENCRYPT_KEY_LIMIT );
+                return 1;
+            }
+
+            keyfilenames[keycount++] = argv[++index];
+        }
+        else if( strcmp(argv[index], "-nt") == 0 )
+        {
+            options.streaming = 1;
+        }
+        else if( strcmp(argv[index], "-c") == 0 && (index+1) < argc )
+        {
+            options.checksumfile = argv[++index];
+        }
+        else if( strcmp(argv[index], "-s") == 0 )
+        {
+            options.stats = 1;
         }
     }
 
     signal(SIGINT, &signal_handler);
-    encrypt(keyfilename, threadcount);
+    encrypt(keyfilenames, keycount, &options);
 
     return 0;
 }
@@ -5,28 +5,171 @@
 
 typedef struct _encrypt_block_info
 {
-    unsigned int                    index;
+    unsigned long long              index;
+    unsigned long long              offset;
     unsigned char*                  block;
     unsigned int                    length;
-    struct _encrypt_block_info*     next;
+    unsigned char                   hole;
+    uint32_t*                       crcs;
 }
 encrypt_block_info_t, *pencrypt_block_info_t;
 
+typedef void (*encrypt_xor_routine_t)(unsigned char* block, const unsigned char* key, unsigned int length);
+
+typedef void (*encrypt_rotate_routine_t)(unsigned char* key, unsigned int keylength, unsigned int shift);
+
+struct _encrypt_key;
+
+typedef void (*encrypt_build_routine_t)(const struct _encrypt_key* key, unsigned int part);
+
+typedef void (*encrypt_register_routine_t)(uint64_t* limbs, unsigned int limbcount, unsigned int keylength, unsigned char* buffer, size_t length);
+
+typedef void (*encrypt_cascade_routine_t)(unsigned char* block, const unsigned char* const* keys, unsigned int keycount, unsigned int length);
+
+typedef uint32_t (*encrypt_crc_routine_t)(uint32_t crc, const unsigned char* data, size_t length);
+
+typedef struct _encrypt_kernels
+{
+    const char*                 name;           // instruction set of the selected kernels
+    encrypt_xor_routine_t       xor_block;      // xor key into block of given length
+    encrypt_rotate_routine_t    rotate_bits;    // rotate key inplace left by 1 to 7 bits
+    encrypt_register_routine_t  register_blocks;// xor consecutive blocks with a key held in limbs
+    encrypt_xor_routine_t       xor_stream;     // xor_block with non-temporal stores, NULL if unsupported
+    encrypt_crc_routine_t       crc32c;         // update a CRC32C without the pre and post inversion
+    encrypt_cascade_routine_t   xor_cascade;    // xor several keys into block of given length at once
+}
+encrypt_kernels_t, *pencrypt_kernels_t;
+
+typedef struct _encrypt_parts
+{
+    unsigned char*          ready;              // per part, set once the part is built
+    pthread_mutex_t*        locks;              // per part, held while the part is built
+    unsigned int            count;              // number of parts
+}
+encrypt_parts_t, *pencrypt_parts_t;
+
+typedef struct _encrypt_key
+{
+    unsigned char*          data;               // key read from the keyfile
+    unsigned long long      length;             // length of the keyfile
+    unsigned char*          schedule;           // key rotated by 0..7 bits, each image twice the key length
+    unsigned char*          pad;                // whole keystream period, repeated to padlength
+    size_t                  padlength;          // length of the pad, a multiple of the period
+    encrypt_parts_t         phases;             // schedule images, built on first use
+    encrypt_parts_t         regions;            // pad regions of ENCRYPT_STREAM_CHUNK bytes, built on first use
+    encrypt_kernels_t       kernels;            // kernels specialized for the key length
+    unsigned char           tiled;              // blocks are processed in tiles, without a schedule
+}
+encrypt_key_t, *pencrypt_key_t;
+
+typedef struct _encrypt_fixed_kernel
+{
+    unsigned int                keylength;      // key length the kernels are specialized for
+    encrypt_xor_routine_t       xor_block;      // xor key into block, fixed trip count for full blocks
+}
+encrypt_fixed_kernel_t, *pencrypt_fixed_kernel_t;
+
+typedef struct _encrypt_keystream
+{
+    unsigned char*          slots;              // rotated key ranges for upcoming items, depth slots
+    unsigned int            slotlength;         // bytes per slot, the item length plus one
+    unsigned int            depth;              // number of slots in the ring, 0 without producers
+    unsigned int            blocklength;        // longest item, items never cross a block boundary
+    unsigned long long      next;               // sequence number of the next item to produce
+    pthread_mutex_t         lock;               // hands out sequence numbers and slots in order
+    sem_t*                  ready;              // per slot, posted once its keystream is produced
+    sem_t*                  vacant;             // per slot, posted once its keystream is consumed
+    pthread_t*              threads;            // array of producer threads
+    unsigned int            threadcount;        // number of producer threads
+}
+encrypt_keystream_t, *pencrypt_keystream_t;
+
+typedef struct _encrypt_input
+{
+    FILE*                   stream;             // input stream
+    unsigned long long      offset;             // stream offset of the next read
+    unsigned long long      base;               // file position the stream started at, stream offset 0
+    unsigned long long      size;               // size of the input from the base on, for sparse files
+    unsigned long long      holestart;          // next hole ending after the offset, ULLONG_MAX if none
+    unsigned long long      holeend;            // end of that hole, where the next data starts
+    unsigned char           sparse;             // input is a regular file with holes
+}
+encrypt_input_t, *pencrypt_input_t;
+
+typedef struct _encrypt_stats
+{
+    unsigned long long      bytes;              // bytes written to the output
+    double                  seconds;            // wall clock time spent encrypting
+    unsigned char           streaming;          // whether non-temporal stores were used
+    unsigned char           checksum;           // whether CRC32C checksums are computed
+    uint32_t                crc[2];             // CRC32C of the whole input and output
+    uint32_t                record[2];          // CRC32C of the input and output of the open record
+    unsigned int            recordlength;       // bytes of the open record checksummed so far
+    FILE*                   sidecar;            // receives the CRC32C of every record, NULL if none
+}
+encrypt_stats_t, *pencrypt_stats_t;
+
+typedef struct _encrypt_ring_cell
+{
+    unsigned long long      sequence;           // position the cell is next filled or emptied at
+    encrypt_block_info_t*   info;               // block held by the cell
+}
+encrypt_ring_cell_t, *pencrypt_ring_cell_t;
+
+typedef struct _encrypt_ring
+{
+    encrypt_ring_cell_t*    cells;              // ring of cells, a power of two of them
+    unsigned long long      mask;               // number of cells minus one
+    unsigned long long      head __attribute__((aligned(64)));  // next position to dequeue from
+    unsigned long long      tail __attribute__((aligned(64)));  // next position to enqueue at
+}
+encrypt_ring_t, *pencrypt_ring_t;
+
 typedef struct _encrypt_context
 {
     unsigned char           quit;               // flag to signal quit
-    pthread_mutex_t         queuelock;          // queue lock for synchronization
-    encrypt_block_info_t*   process_queue;      // queue containing blocks ready for processing
-    encrypt_block_info_t*   completion_queue;   // queue containing blocks completed processing
+    encrypt_ring_t*         process_queues;     // per worker lock-free ring of blocks ready for processing
+    unsigned int            nextworker;         // hands out worker numbers as the workers start
+    encrypt_block_info_t**  completion_window;  // completed blocks by index modulo the window size
+    unsigned int            windowsize;         // slots in the completion window, at least the blocks in flight
     sem_t                   process_event;      // signal worker threads to start processing
-    sem_t                   completion_event;   // signal to main thread about processing complete
+    sem_t                   completion_event;   // signal to writer thread about processing complete
+    sem_t                   window_event;       // signal to main thread about a block written out
+    unsigned long long      blockcount;         // blocks read, ULLONG_MAX until the end of the input
+    pthread_t               writer;             // writer thread, writing out completed blocks in order
+    unsigned char           writing;            // whether the writer thread is running
+    encrypt_stats_t*        stats;              // output totals and checksums, updated by the writer
     pthread_t*              threads;            // array of worker threads
     unsigned int            threadcount;        // number of worker threads
-    unsigned char*          key;                // key read from the keyfile
-    unsigned int            keylength;          // length of the keyfile
+    const encrypt_key_t*    key;                // keys and their rotation schedules, shared read-only
+    unsigned int            keycount;           // number of keys applied in cascade
+    encrypt_keystream_t     keystream;          // ring of rotated keys filled ahead of the workers
+    unsigned char           checksum;           // compute the CRC32C of every block
 }
 encrypt_context_t, *pencrypt_context_t;
 
-int encrypt(char* keyfilename, unsigned int threadcount);
+typedef struct _encrypt_options
+{
+    unsigned int            threadcount;        // number of worker threads, 0 to run sequentially
+    int                     producercount;      // keystream producer threads, 0 for none
+    unsigned int            windowsize;         // blocks in flight in the parallel pipeline, 0 for the default
+    size_t                  padlimit;           // memory budget for caching the whole keystream
+    unsigned char           streaming;          // use non-temporal stores for the output
+    unsigned char           stats;              // report throughput on stderr when done
+    const char*             checksumfile;       // sidecar for per-block CRC32C checksums, NULL for none
+}
+encrypt_options_t, *pencrypt_options_t;
+
+typedef struct _encrypt_session
+{
+    encrypt_key_t*          keys;               // keys applied in cascade, with their schedules and pads
+    unsigned int            keycount;           // number of keys
+}
+encrypt_session_t, *pencrypt_session_t;
+
+int encrypt_session_init(encrypt_session_t* session, char** keyfilenames, unsigned int keycount, size_t padlimit);
+void encrypt_session_deinit(encrypt_session_t* session);
+int encrypt_at(const encrypt_session_t* session, unsigned long long offset, unsigned char* buffer, size_t length);
+int encrypt(char** keyfilenames, unsigned int keycount, const encrypt_options_t* options);
 
 #endif // _ENCRYPT_H_
\ No newline at end of file
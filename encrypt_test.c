@@ -0,0 +1,200 @@
+//
+// Boundary checks for 64-bit stream arithmetic, compared byte by byte against the rotated key
+// read bit by bit. Keys longer than 4 GiB, where positions within the key no longer fit in 32
+// bits, use a 5 GiB anonymous mapping of which only the pages around the 4 GiB mark, the start
+// and the end are written, and go through both encrypt_block_rotated and encrypt_at. Small keys
+// are run through encrypt_at around block 2^32, with a pad and without one.
+//
+// gcc -O2 -o encrypt_test encrypt_test.c -lpthread && ./encrypt_test
+//
+
+#define main encrypt_main
+#include "encrypt.c"
+#undef main
+
+#include <sys/mman.h>
+
+#define ENCRYPT_TEST_KEY_LENGTH     (5ull << 30)            // key length, past the 32 bit range
+#define ENCRYPT_TEST_SPAN           (2u * 1024 * 1024)      // bytes written around each boundary
+#define ENCRYPT_TEST_LENGTH         (300u * 1024)           // bytes encrypted per check
+#define ENCRYPT_TEST_BLOCKS         (1ull << 32)            // block index small keys are checked around
+
+static void encrypt_test_fill(unsigned char* key, unsigned long long start, unsigned long long length)
+{
+    unsigned long long index = 0;
+
+    for( index = start; index < start + length; index++ )
+    {
+        key[index] = (unsigned char)(index * 0x9e3779b1ull >> 24);
+    }
+}
+
+static unsigned char encrypt_test_expected(const unsigned char* key, unsigned long long keylength, unsigned long long offset)
+{
+    unsigned long long bit = (offset / keylength + (offset % keylength) * 8) % (keylength * 8);
+    unsigned long long pos = bit / 8;
+    unsigned int shift = (unsigned int)(bit % 8);
+
+    if( shift == 0 )
+        return key[pos];
+
+    return (unsigned char)((key[pos] << shift) | (key[pos + 1 < keylength ? pos + 1 : 0] >> (8 - shift)));
+}
+
+static int encrypt_test_compare(const char* name, const unsigned char* block, const unsigned char* key, unsigned long long keylength, unsigned long long offset, unsigned int length)
+{
+    unsigned int index = 0;
+
+    for( index = 0; index < length; index++ )
+    {
+        if( block[index] != encrypt_test_expected(key, keylength, offset + index) )
+        {
+            fprintf( stderr, "%s: mismatch at stream offset %llu\n", name, offset + index );
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int encrypt_test_huge_key(void)
+{
+    int failures = 0;
+    unsigned int index = 0;
+    unsigned char* block = NULL;
+    encrypt_key_t key;
+    encrypt_session_t session;
+    const unsigned long long keylength = ENCRYPT_TEST_KEY_LENGTH;
+    const unsigned long long offsets[] =
+    {
+        (4ull << 30) - 1000,                            // block 0, across the 4 GiB mark
+        keylength - 1000,                               // block 0 into block 1, across the key end
+        keylength + (4ull << 30) - 1000,                // block 1, one bit into the next byte
+        3 * keylength + (4ull << 30) - 7,               // block 3
+        8 * keylength + (4ull << 30) - 100000,          // block 8, a whole byte on
+        9 * keylength - 100000,                         // block 8 into block 9, across the key end
+    };
+
+    memset( &key, 0, sizeof(encrypt_key_t) );
+    memset( &session, 0, sizeof(encrypt_session_t) );
+
+    key.length = keylength;
+    key.data = (unsigned char*) mmap(NULL, keylength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    block = (unsigned char*) malloc(ENCRYPT_TEST_LENGTH);
+
+    if( key.data == MAP_FAILED || block == NULL )
+    {
+        fprintf( stderr, "encrypt_test: out of memory\n" );
+        return 1;
+    }
+
+    encrypt_test_fill( key.data, 0, ENCRYPT_TEST_SPAN );
+    encrypt_test_fill( key.data, (4ull << 30) - ENCRYPT_TEST_SPAN, 2 * ENCRYPT_TEST_SPAN );
+    encrypt_test_fill( key.data, keylength - ENCRYPT_TEST_SPAN, ENCRYPT_TEST_SPAN );
+
+    if( encrypt_key_schedule_init(&key) != 0 )
+        return 1;
+
+    encrypt_kernels_specialize(&key.kernels, key.length);
+    session.keys = &key;
+    session.keycount = 1;
+
+    for( index = 0; index < sizeof(offsets) / sizeof(offsets[0]); index++ )
+    {
+        memset( block, 0, ENCRYPT_TEST_LENGTH );
+        encrypt_block_rotated(block, ENCRYPT_TEST_LENGTH, key.data, keylength,
+                              encrypt_key_shift(&key, offsets[index]));
+        failures += encrypt_test_compare("encrypt_block_rotated", block, key.data, keylength, offsets[index],
+                                         (unsigned int) (keylength - offsets[index] % keylength < ENCRYPT_TEST_LENGTH ?
+                                                         keylength - offsets[index] % keylength : ENCRYPT_TEST_LENGTH));
+
+        memset( block, 0, ENCRYPT_TEST_LENGTH );
+        failures += encrypt_at(&session, offsets[index], block, ENCRYPT_TEST_LENGTH) != 0;
+        failures += encrypt_test_compare("encrypt_at", block, key.data, keylength, offsets[index], ENCRYPT_TEST_LENGTH);
+    }
+
+    free( block );
+    munmap( key.data, keylength );
+
+    return failures;
+}
+
+//
+// A small key reaches block 2^32 after 2^32 key lengths of stream, where 32-bit block indices
+// would wrap. The pad, when there is one, is checked at the same offsets, folded into its period.
+//
+static int encrypt_test_small_key(unsigned int keylength, size_t padlimit)
+{
+    int failures = 0;
+    unsigned int index = 0;
+    unsigned char* block = NULL;
+    encrypt_key_t key;
+    encrypt_session_t session;
+    const unsigned long long base = ENCRYPT_TEST_BLOCKS * keylength;
+    const unsigned long long offsets[] =
+    {
+        base - ENCRYPT_TEST_LENGTH / 2,                 // across the first byte of block 2^32
+        base - 1,
+        base,
+        base + 1,
+        base + 1000,
+        base + 8ull * keylength * keylength - 3,        // a whole keystream period on
+    };
+
+    memset( &key, 0, sizeof(encrypt_key_t) );
+    memset( &session, 0, sizeof(encrypt_session_t) );
+
+    key.length = keylength;
+    key.data = (unsigned char*) malloc(keylength);
+    block = (unsigned char*) malloc(ENCRYPT_TEST_LENGTH);
+
+    if( key.data == NULL || block == NULL )
+    {
+        fprintf( stderr, "encrypt_test: out of memory\n" );
+        free( key.data );
+        free( block );
+        return 1;
+    }
+
+    encrypt_test_fill( key.data, 0, keylength );
+
+    if( encrypt_key_schedule_init(&key) != 0 || encrypt_key_pad_init(&key, padlimit) != 0 || (padlimit > 0) != (key.pad != NULL) )
+    {
+        fprintf( stderr, "encrypt_test: %u byte key not set up as expected\n", keylength );
+        encrypt_key_deinit( &key );
+        free( block );
+        return 1;
+    }
+
+    encrypt_kernels_specialize(&key.kernels, key.length);
+    session.keys = &key;
+    session.keycount = 1;
+
+    for( index = 0; index < sizeof(offsets) / sizeof(offsets[0]); index++ )
+    {
+        memset( block, 0, ENCRYPT_TEST_LENGTH );
+        failures += encrypt_at(&session, offsets[index], block, ENCRYPT_TEST_LENGTH) != 0;
+        failures += encrypt_test_compare(key.pad != NULL ? "encrypt_at with pad" : "encrypt_at", block, key.data, keylength, offsets[index], ENCRYPT_TEST_LENGTH);
+    }
+
+    encrypt_key_deinit( &key );
+    free( block );
+
+    return failures;
+}
+
+int main(void)
+{
+    int failures = 0;
+
+    encrypt_kernels_init();
+
+    failures += encrypt_test_huge_key();
+    failures += encrypt_test_small_key(16, ENCRYPT_PAD_LIMIT);
+    failures += encrypt_test_small_key(16, 0);
+    failures += encrypt_test_small_key(37, ENCRYPT_PAD_LIMIT);
+    failures += encrypt_test_small_key(37, 0);
+
+    fprintf( stderr, "encrypt_test: %s\n", failures == 0 ? "passed" : "FAILED" );
+    return failures != 0;
+}
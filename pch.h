@@ -3,6 +3,10 @@
 
 // Headers
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <malloc.h>
 #include <assert.h>
@@ -12,6 +16,16 @@
 #include <signal.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ENCRYPT_X86
+#include <immintrin.h>
+#endif
 
 // Error Handling Macros
 